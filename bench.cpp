@@ -0,0 +1,319 @@
+// Microbenchmarks for the engine's hot functions.
+//
+//   g++ -std=c++17 -O2 -pthread -o gridrun-bench bench.cpp -lncurses
+//   ./gridrun-bench [--out FILE] [--filter TEXT] [--min-time SECONDS]
+//
+// Results are written as JSON (stdout by default) so runs before and after
+// an engine change can be diffed.
+#define GRIDRUN_NO_MAIN
+#include "game.cpp"
+
+struct BenchResult {
+    string name;
+    vector<pair<string, long long>> params;
+    long long samples = 0;
+    double minNs = 0, medianNs = 0, meanNs = 0;
+};
+
+string benchFilter;
+double benchMinTime = 0.3; // Seconds of timed work per case
+vector<BenchResult> benchResults;
+volatile float benchSink; // Keeps results the optimizer would otherwise drop
+
+// Times run() until benchMinTime seconds have been measured (at least 5
+// samples, at most 100000). setup() runs before every sample and is not timed,
+// so state a sample mutates can be restored there; a case stops early once
+// setup and run together take ten times the budget.
+template <typename Setup, typename Run>
+void bench(const string& name, vector<pair<string, long long>> params, Setup setup, Run run) {
+    string fullName = name;
+    for (auto& [key, value] : params) fullName += "/" + key + "=" + to_string(value);
+    if (!benchFilter.empty() && fullName.find(benchFilter) == string::npos) return;
+
+    vector<double> times;
+    double total = 0;
+    auto caseStart = chrono::steady_clock::now();
+    auto overBudget = [&] {
+        return chrono::duration<double>(chrono::steady_clock::now() - caseStart).count() > benchMinTime * 10;
+    };
+    while (times.size() < 5 || (total < benchMinTime * 1e9 && times.size() < 100000 && !overBudget())) {
+        setup();
+        auto start = chrono::steady_clock::now();
+        run();
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        times.push_back(ns);
+        total += ns;
+    }
+
+    sort(times.begin(), times.end());
+    BenchResult result;
+    result.name = name;
+    result.params = params;
+    result.samples = times.size();
+    result.minNs = times.front();
+    result.medianNs = times[times.size() / 2];
+    result.meanNs = total / times.size();
+    benchResults.push_back(result);
+    fprintf(stderr, "%-48s %14.0f ns  (%lld samples)\n", fullName.c_str(), result.medianNs, result.samples);
+}
+
+// Plain level with the given share of walls and no enemies or terrain
+void makeOpenGrid(int size, int wallPercent) {
+    worldRows = worldCols = size;
+    grid.resize(size, size, '.');
+    terrainGrid.resize(size, size, '.');
+    clearEnemies();
+    uniform_int_distribution<int> percent(0, 99);
+    for (int x = 0; x < size; ++x) {
+        for (int y = 0; y < size; ++y) {
+            if (percent(rng) < wallPercent) grid.at(x, y) = '#';
+        }
+    }
+    player1 = {0, 0};
+    grid.at(0, 0) = '1';
+    grid.at(size - 1, size - 1) = '.';
+    rebuildMapBits();
+    hierarchyStale = true;
+}
+
+void benchDijkstra() {
+    for (int size : {20, 64, 256, 1024}) {
+        for (int walls : {0, 10, 30}) {
+            rng.seed(size * 100 + walls);
+            makeOpenGrid(size, walls);
+            pair<int, int> src = {size - 1, size - 1};
+            size_t length = 1;
+            bench("dijkstraPath", {{"size", size}, {"walls", walls}}, [] {}, [&] {
+                length = dijkstraPath(src, player1).size();
+            });
+            if (length == 0 && walls == 0) fprintf(stderr, "dijkstraPath found no path on an open grid\n");
+        }
+    }
+}
+
+void benchFloodFill() {
+    for (int size : {256, 1024, 4096}) {
+        rng.seed(size);
+        makeOpenGrid(size, 10);
+        BitPlane reach;
+        bench("floodFill", {{"size", size}, {"walls", 10}}, [] {}, [&] {
+            floodFill(reach, player1, mapBits.walls);
+        });
+    }
+}
+
+void benchMoveEnemies() {
+    for (int incremental : {0, 1})
+    for (int size : {256, 1024})
+    for (int count : {10, 100, 1000, 10000}) {
+        incrementalAI = incremental;
+        rng.seed(count);
+        makeOpenGrid(size, 10);
+        multiplayer = false;
+        player1Invincibility = INT_MAX; // Keep the player alive and in place
+        uniform_int_distribution<int> cellDist(0, size - 1);
+        const int types[] = {NORMAL, NORMAL, WANDERER, HUNTER, GHOST};
+        const char symbols[] = {'E', 'E', 'W', 'H', 'G'};
+        for (int i = 0; i < count;) {
+            int x = cellDist(rng), y = cellDist(rng);
+            if (!isFree(x, y)) continue;
+            placeTile(x, y, symbols[i % 5]);
+            spawnEnemy(x, y, types[i % 5]);
+            ++i;
+        }
+
+        if (!incremental) {
+            // Every sample starts from the same positions
+            TileGrid startGrid = grid;
+            MapBits startBits = mapBits;
+            auto startEnemies = enemies;
+            GameRng startRng = rng;
+            for (int threads : {1, 4}) {
+                if (threads > 1 && count < 1000) continue; // Too few to hand out
+                aiThreads = threads;
+                bench("moveEnemies", {{"enemies", count}, {"size", size}, {"incremental", 0}, {"threads", threads}}, [&] {
+                    grid = startGrid;
+                    mapBits = startBits;
+                    enemies = startEnemies;
+                    rebuildEnemyIndex();
+                    rng = startRng;
+                }, [] {
+                    moveEnemies();
+                });
+            }
+            aiThreads = 1;
+        } else {
+            // Routes are state, so play consecutive ticks with the player
+            // stepping back and forth instead of restoring the start. First
+            // plans are spread over REPLAN_BUDGET enemies per tick and are
+            // played out before timing, so this measures route repair.
+            enemyRoutes.clear();
+            auto stepPlayer = [] {
+                pair<int, int> next = {player1.first ^ 1, player1.second};
+                if (!isFree(next.first, next.second)) return;
+                setTile(player1.first, player1.second, '.');
+                player1 = next;
+                setTile(next.first, next.second, '1');
+            };
+            for (int i = 0; i <= count / REPLAN_BUDGET + 1; ++i) {
+                stepPlayer();
+                moveEnemies();
+            }
+            bench("moveEnemies", {{"enemies", count}, {"size", size}, {"incremental", 1}}, stepPlayer, [] {
+                moveEnemies();
+            });
+        }
+        player1Invincibility = 0;
+    }
+    incrementalAI = false;
+}
+
+void benchNoise() {
+    for (int size : {20, 256, 1024, 4096}) {
+        NoiseGrid noise;
+        bench("generateNoise", {{"size", size}}, [] {}, [&] {
+            generateNoise(noise, 1, 0, 0, size, size);
+            benchSink = noise.at(0, 0);
+        });
+    }
+}
+
+void benchSetupLevel() {
+    for (int size : {20, 256, 1024}) {
+        for (int lvl : {1, 10, 50}) {
+            worldRows = worldCols = size;
+            bench("setupLevel", {{"size", size}, {"level", lvl}}, [&] {
+                level = lvl;
+            }, [] {
+                setupLevel();
+            });
+        }
+    }
+    level = 1;
+}
+
+// Draws into a terminal that writes to /dev/null, so the cost measured is
+// building the frame and the escape sequences, not the terminal emulator.
+// printGrid is the ncurses renderer, printGridAnsi the raw ANSI one and
+// printGridNull what is left with drawing turned off.
+void benchPrintGrid() {
+    FILE* out = fopen("/dev/null", "w");
+    FILE* in = fopen("/dev/null", "r");
+    if (!out || !in) return;
+    setenv("LINES", "60", 1);
+    setenv("COLUMNS", "200", 1);
+    SCREEN* screen = newterm("xterm-256color", out, in);
+    if (!screen) fprintf(stderr, "printGrid skipped: no xterm-256color terminfo entry\n");
+
+    for (string name : {"printGrid", "printGridAnsi", "printGridNull"}) {
+        if (name == "printGrid") {
+            if (!screen) continue;
+            renderer = make_unique<NcursesRenderer>(screen);
+        } else if (name == "printGridAnsi") {
+            renderer = make_unique<AnsiRenderer>(fileno(out), -1);
+        } else {
+            renderer = make_unique<NullRenderer>();
+        }
+
+        for (int size : {20, 256, 1024}) {
+            worldRows = worldCols = size;
+            rng.seed(size);
+            newGame(size);
+            printGrid();
+            bench(name, {{"size", size}, {"full", 1}}, [] {
+                fullRedraw = true;
+            }, [] {
+                printGrid();
+            });
+
+            // One enemy step's worth of changes on an otherwise settled screen
+            TileGrid startGrid = grid;
+            MapBits startBits = mapBits;
+            auto startEnemies = enemies;
+            GameRng startRng = rng;
+            bench(name, {{"size", size}, {"full", 0}}, [&] {
+                grid = startGrid;
+                mapBits = startBits;
+                enemies = startEnemies;
+                rebuildEnemyIndex();
+                rng = startRng;
+                fullRedraw = true;
+                printGrid();
+                moveEnemies();
+            }, [] {
+                printGrid();
+            });
+        }
+        renderer = make_unique<NullRenderer>();
+    }
+
+    if (screen) delscreen(screen);
+    fclose(out);
+    fclose(in);
+}
+
+// One batched step of every env, so envs / median_ns is steps per nanosecond
+void benchVecStep() {
+    for (int count : {1000, 10000}) {
+        for (int threads : {1, 4}) {
+            VecEnv* env = gridrun_vec_create(count, threads, 20, 20, count);
+            vector<uint8_t> obs(count * env->obsSize()), dones(count);
+            vector<float> rewards(count);
+            vector<int32_t> actions(count);
+            rng.seed(count);
+            env->reset(obs.data());
+            bench("vecStep", {{"envs", count}, {"threads", threads}}, [&] {
+                for (auto& action : actions) action = rng() % VEC_ACTIONS;
+            }, [&] {
+                env->step(actions.data(), obs.data(), rewards.data(), dones.data());
+            });
+            gridrun_vec_destroy(env);
+        }
+    }
+    worldRows = worldCols = 20;
+}
+
+void writeResults(FILE* out) {
+    fprintf(out, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < benchResults.size(); ++i) {
+        const BenchResult& r = benchResults[i];
+        fprintf(out, "    {\"name\": \"%s\", \"params\": {", r.name.c_str());
+        for (size_t j = 0; j < r.params.size(); ++j) {
+            fprintf(out, "%s\"%s\": %lld", j ? ", " : "", r.params[j].first.c_str(), r.params[j].second);
+        }
+        fprintf(out, "}, \"samples\": %lld, \"min_ns\": %.0f, \"median_ns\": %.0f, \"mean_ns\": %.0f}%s\n",
+                r.samples, r.minNs, r.medianNs, r.meanNs, i + 1 < benchResults.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[]) {
+    string outFile;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--out" && i + 1 < argc) {
+            outFile = argv[++i];
+        } else if (arg == "--filter" && i + 1 < argc) {
+            benchFilter = argv[++i];
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            benchMinTime = max(0.0, atof(argv[++i]));
+        }
+    }
+
+    benchDijkstra();
+    benchFloodFill();
+    benchMoveEnemies();
+    benchNoise();
+    benchSetupLevel();
+    benchPrintGrid();
+    benchVecStep();
+
+    FILE* out = outFile.empty() ? stdout : fopen(outFile.c_str(), "w");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s\n", outFile.c_str());
+        return 1;
+    }
+    writeResults(out);
+    if (out != stdout) fclose(out);
+    return 0;
+}
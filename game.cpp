@@ -1,40 +1,247 @@
 #include <iostream>
 #include <vector>
+#include <array>
 #include <queue>
+#include <deque>
 #include <tuple>
 #include <climits>
 #include <termios.h>
+#include <sys/ioctl.h>
+#include <csignal>
 #include <unistd.h>
 #include <algorithm>
 #include <cstdlib>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <atomic>
 #include <chrono>
 #include <fstream>
+#include <sstream>
 #include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
 #include <random>
 #include <ncurses.h>
+#include <poll.h>
 #include <ctime>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cerrno>
 using namespace std;
 
-const int N = 20;
-char grid[N][N];
-char terrainGrid[N][N]; // Stores underlying terrain
-pair<int, int> player1;
-pair<int, int> player2;
-vector<tuple<int, int, int>> enemies; // x, y, enemy type
-pair<int, int> safePoint;
+// World size limits for --width/--height
+const int MIN_WORLD_SIZE = 10;
+const int MAX_WORLD_SIZE = 4096;
+
+// Flat row-major tile storage. x is the row and y the column, matching the
+// grid[x][y] layout used throughout the game.
+struct TileGrid {
+    int rows = 0;
+    int cols = 0;
+    vector<char> cells;
+
+    void resize(int r, int c, char fillChar) {
+        rows = r;
+        cols = c;
+        cells.assign((size_t)r * c, fillChar);
+    }
+
+    bool inBounds(int x, int y) const {
+        return x >= 0 && y >= 0 && x < rows && y < cols;
+    }
+
+    int index(int x, int y) const { return x * cols + y; }
+    char& at(int x, int y) { return cells[(size_t)x * cols + y]; }
+    char at(int x, int y) const { return cells[(size_t)x * cols + y]; }
+};
+
+// One bit per cell in the same layout as TileGrid, with each row padded to
+// whole 64-bit words so a row can be tested and shifted a word at a time.
+struct BitPlane {
+    int rows = 0;
+    int cols = 0;
+    int words = 0; // Per row
+    vector<uint64_t> bits;
+
+    void resize(int r, int c) {
+        rows = r;
+        cols = c;
+        words = (c + 63) / 64;
+        bits.assign((size_t)r * words, 0);
+    }
+
+    bool test(int x, int y) const { return bits[(size_t)x * words + (y >> 6)] >> (y & 63) & 1; }
+
+    void set(int x, int y, bool on) {
+        uint64_t& word = bits[(size_t)x * words + (y >> 6)];
+        uint64_t mask = 1ULL << (y & 63);
+        word = on ? word | mask : word & ~mask;
+    }
+
+    uint64_t* row(int x) { return bits.data() + (size_t)x * words; }
+    const uint64_t* row(int x) const { return bits.data() + (size_t)x * words; }
+
+    // Bits of word w that are inside the map
+    uint64_t wordMask(int w) const {
+        int used = cols - w * 64;
+        return used >= 64 ? ~0ULL : (1ULL << used) - 1;
+    }
+};
+
+// Game settings, fixed once the command line has been parsed
+int worldRows = 20; // --height
+int worldCols = 20; // --width
+bool multiplayer = false;
+bool endlessWorld = false; // --endless
+bool textSaves = false; // --text-save
+bool incrementalAI = false; // --ai incremental
+int aiThreads = 1; // --ai-threads, workers deciding enemy moves
 int dx[] = {-1, 1, 0, 0, -1, -1, 1, 1}; // Adding diagonals
 int dy[] = {0, 0, -1, 1, -1, 1, -1, 1};
-int level = 1;
-int score = 0;
-int health1 = 3, health2 = 3;
-int armor1 = 0, armor2 = 0;
-int weapons1 = 0, weapons2 = 0;
-int enemyMoveDelay = 100;
-bool multiplayer = false;
-bool paused = false;
-int gameTime = 0;
-mt19937 rng(time(nullptr));
+
+// Length of one game frame
+const int FRAME_MS = 50;
+
+// Game state is per thread so --sweep can play several games at once
+thread_local TileGrid grid;
+thread_local TileGrid terrainGrid; // Stores underlying terrain
+
+// Layers of grid and terrainGrid as bit planes, kept in step by placeTile()
+// and setTile(). Wall, terrain and "is free" tests read these, and bulk
+// queries like floodFill() work on them a word at a time.
+struct MapBits {
+    BitPlane walls;
+    BitPlane enemies;  // E W H G B
+    BitPlane pickups;  // + S I > A
+    BitPlane traps;
+    BitPlane water;
+    BitPlane lava;
+    BitPlane occupied; // Anything but floor on grid
+};
+thread_local MapBits mapBits;
+thread_local pair<int, int> player1;
+thread_local pair<int, int> player2;
+thread_local pair<int, int> safePoint;
+thread_local int level = 1;
+thread_local int score = 0;
+thread_local int health1 = 3, health2 = 3;
+thread_local int armor1 = 0, armor2 = 0;
+thread_local int weapons1 = 0, weapons2 = 0;
+thread_local int enemyMoveDelay = 100;
+thread_local int lastEnemyMove = 0; // Frames since enemies last moved
+thread_local bool paused = false;
+thread_local int gameTime = 0;
+thread_local char caughtPlayer = 0; // Set to '1' or '2' when a player is caught
+thread_local long long tickCount = 0; // Frames simulated since the game started
+// mt19937 kept behind a pointer, so binding a World (swapWorld) moves a
+// pointer instead of 2.5 KB of generator state. It draws exactly what a plain
+// mt19937 with the same seed draws.
+class GameRng {
+public:
+    using result_type = mt19937::result_type;
+
+    explicit GameRng(result_type seed = mt19937::default_seed) : engine(make_unique<mt19937>(seed)) {}
+    explicit GameRng(seed_seq& seq) : engine(make_unique<mt19937>(seq)) {}
+    GameRng(const GameRng& other) : engine(make_unique<mt19937>(*other.engine)) {}
+    GameRng& operator=(const GameRng& other) {
+        *engine = *other.engine;
+        return *this;
+    }
+    GameRng(GameRng&&) = default;
+    GameRng& operator=(GameRng&&) = default;
+
+    static constexpr result_type min() { return mt19937::min(); }
+    static constexpr result_type max() { return mt19937::max(); }
+    result_type operator()() { return (*engine)(); }
+    void seed(result_type value) { engine->seed(value); }
+
+private:
+    unique_ptr<mt19937> engine;
+};
+
+thread_local GameRng rng(time(nullptr));
+thread_local uint32_t gameSeed = 0; // Seed newGame() was given, levels draw their own streams from it
+
+using Clock = chrono::steady_clock;
+
+// Frame profiler. A PhaseTimer adds the time spent in its scope to the
+// current tick's total for that phase, and stepGame() closes the tick into a
+// rolling window per phase (and a CSV row with --profile-out). Phases nest,
+// so enemies includes fields and most of paths. While profiling is off a
+// timer is a single flag test.
+enum ProfilePhase { PHASE_INPUT, PHASE_PLAYER, PHASE_ENEMIES, PHASE_FIELDS, PHASE_PATHS, PHASE_LEVEL, PHASE_RENDER, PHASE_COUNT };
+const char* const PHASE_NAMES[PHASE_COUNT] = {"input", "player", "enemies", "fields", "paths", "level", "render"};
+const char* const PHASE_LABELS[PHASE_COUNT] = {"in", "pl", "en", "fld", "path", "lvl", "draw"};
+const int PROFILE_WINDOW = 256; // Ticks kept per phase for min/avg/p99
+
+thread_local bool profiling = false;
+thread_local long long phaseNs[PHASE_COUNT];   // This tick so far
+thread_local vector<long long> phaseHistory;   // PROFILE_WINDOW ticks per phase, a ring
+thread_local long long profiledTicks = 0;
+FILE* profileOut = nullptr; // --profile-out
+
+struct PhaseTimer {
+    ProfilePhase phase;
+    bool on;
+    Clock::time_point start;
+
+    explicit PhaseTimer(ProfilePhase p) : phase(p), on(profiling) {
+        if (on) start = Clock::now();
+    }
+    ~PhaseTimer() {
+        if (on) phaseNs[phase] += chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+    }
+};
+
+void endProfileTick() {
+    if (!profiling) return;
+    if (phaseHistory.empty()) phaseHistory.assign(PHASE_COUNT * PROFILE_WINDOW, 0);
+
+    int slot = profiledTicks % PROFILE_WINDOW;
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        phaseHistory[p * PROFILE_WINDOW + slot] = phaseNs[p];
+    }
+    profiledTicks++;
+
+    if (profileOut) {
+        fprintf(profileOut, "%lld", tickCount);
+        for (long long ns : phaseNs) fprintf(profileOut, ",%lld", ns / 1000);
+        fputc('\n', profileOut);
+    }
+    fill(begin(phaseNs), end(phaseNs), 0);
+}
+
+// One line of min/avg/p99 per phase over the last PROFILE_WINDOW ticks, in microseconds
+string profileSummary() {
+    int n = min<long long>(profiledTicks, PROFILE_WINDOW);
+    if (n == 0) return "Profile: waiting for the first tick";
+
+    string line = "us min/avg/p99";
+    vector<long long> samples;
+    char buf[64];
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        samples.assign(phaseHistory.begin() + p * PROFILE_WINDOW, phaseHistory.begin() + p * PROFILE_WINDOW + n);
+        sort(samples.begin(), samples.end());
+        long long total = accumulate(samples.begin(), samples.end(), 0LL);
+        snprintf(buf, sizeof(buf), "  %s %lld/%lld/%lld", PHASE_LABELS[p], samples[0] / 1000,
+                 total / n / 1000, samples[n * 99 / 100] / 1000);
+        line += buf;
+    }
+    return line;
+}
 
 // Colors for ncurses
 #define COLOR_PLAYER1 1
@@ -58,6 +265,144 @@ enum EnemyType {
     GHOST = 3,      // Can move through walls
     BOSS = 4        // Stronger, requires multiple hits
 };
+const int ENEMY_TYPES = 5;
+
+// Each enemy type's behavior as a policy type, known at compile time. The
+// per-type tables below are built from these, and the enemy tick runs one
+// loop instantiation per policy over that type's enemies. A new type needs
+// an EnemyType value and a policy added to EnemyPolicies.
+struct NormalPolicy {
+    static constexpr EnemyType type = NORMAL;
+    static constexpr char symbol = 'E';
+    static constexpr int hitPoints = 1;
+    static constexpr int killScore = 10;
+    static constexpr int spawnDistance = 5;    // Closest a level places it to a player
+    static constexpr bool throughWalls = false;
+    static constexpr int wanderPercent = 0;    // Chance of a random step instead of chasing
+    static constexpr int extraMovePercent = 0; // Chance of each further step in a tick
+    static constexpr short colorPair = COLOR_ENEMY;
+    static constexpr chtype attrs = 0;
+    static constexpr int onLevel(int lvl) { return lvl; }
+};
+
+struct WandererPolicy : NormalPolicy {
+    static constexpr EnemyType type = WANDERER;
+    static constexpr char symbol = 'W';
+    static constexpr int wanderPercent = 30;
+    static constexpr int onLevel(int lvl) { return lvl / 2; }
+};
+
+struct HunterPolicy : NormalPolicy {
+    static constexpr EnemyType type = HUNTER;
+    static constexpr char symbol = 'H';
+    static constexpr int spawnDistance = 7;
+    static constexpr int extraMovePercent = 50;
+    static constexpr int onLevel(int lvl) { return lvl / 3; }
+};
+
+struct GhostPolicy : NormalPolicy {
+    static constexpr EnemyType type = GHOST;
+    static constexpr char symbol = 'G';
+    static constexpr int spawnDistance = 7;
+    static constexpr bool throughWalls = true;
+    static constexpr chtype attrs = A_BLINK;
+    static constexpr int onLevel(int lvl) { return lvl / 4; }
+};
+
+struct BossPolicy : NormalPolicy {
+    static constexpr EnemyType type = BOSS;
+    static constexpr char symbol = 'B';
+    static constexpr int hitPoints = 3;
+    static constexpr int killScore = 50;
+    static constexpr int spawnDistance = 10;
+    static constexpr short colorPair = COLOR_BOSS;
+    static constexpr int onLevel(int lvl) { return lvl % 5 == 0 ? 1 : 0; } // Boss every 5 levels
+};
+
+template <typename... Policies>
+struct EnemyPolicyList {
+    static constexpr int size = sizeof...(Policies);
+
+    // Calls fn(Policy()) for each policy, in list order
+    template <typename Fn>
+    static constexpr void forEach(Fn&& fn) { (fn(Policies()), ...); }
+};
+
+using EnemyPolicies = EnemyPolicyList<NormalPolicy, WandererPolicy, HunterPolicy, GhostPolicy, BossPolicy>;
+static_assert(EnemyPolicies::size == ENEMY_TYPES, "every enemy type needs a policy");
+
+// Table by enemy type of get(Policy()) for every policy
+template <typename Get>
+constexpr auto enemyTable(Get get) {
+    array<decltype(get(NormalPolicy())), ENEMY_TYPES> table{};
+    EnemyPolicies::forEach([&](auto policy) { table[decltype(policy)::type] = get(policy); });
+    return table;
+}
+
+constexpr auto ENEMY_SYMBOLS = enemyTable([](auto p) { return decltype(p)::symbol; });
+constexpr auto ENEMY_HIT_POINTS = enemyTable([](auto p) { return decltype(p)::hitPoints; });
+constexpr auto ENEMY_KILL_SCORE = enemyTable([](auto p) { return decltype(p)::killScore; });
+constexpr auto ENEMY_THROUGH_WALLS = enemyTable([](auto p) { return decltype(p)::throughWalls; });
+constexpr auto ENEMY_WANDER_PERCENT = enemyTable([](auto p) { return decltype(p)::wanderPercent; });
+constexpr auto ENEMY_EXTRA_MOVE_PERCENT = enemyTable([](auto p) { return decltype(p)::extraMovePercent; });
+constexpr auto ENEMY_ON_LEVEL = enemyTable([](auto p) { return &decltype(p)::onLevel; });
+const int HIT_STAGGER = 2; // Enemy ticks an enemy that survives a hit sits out
+
+// Live enemies as parallel arrays, indexed by slot. Removing one moves the
+// last enemy into its slot, so slots change while ids stay the same for an
+// enemy's whole life.
+struct EnemyStore {
+    vector<int> x, y;
+    vector<uint8_t> type;
+    vector<int> hp;       // Hits left
+    vector<int> cooldown; // Enemy ticks left to sit out
+    vector<int> id;
+    int typeCount[ENEMY_TYPES] = {};
+
+    size_t size() const { return x.size(); }
+    bool empty() const { return x.empty(); }
+
+    void clear() {
+        x.clear();
+        y.clear();
+        type.clear();
+        hp.clear();
+        cooldown.clear();
+        id.clear();
+        fill(begin(typeCount), end(typeCount), 0);
+    }
+
+    void push(int ex, int ey, int t, int hitPoints, int wait, int enemyId) {
+        x.push_back(ex);
+        y.push_back(ey);
+        type.push_back(t);
+        hp.push_back(hitPoints);
+        cooldown.push_back(wait);
+        id.push_back(enemyId);
+        typeCount[t]++;
+    }
+
+    void swapRemove(size_t slot) {
+        typeCount[type[slot]]--;
+        x[slot] = x.back();
+        y[slot] = y.back();
+        type[slot] = type.back();
+        hp[slot] = hp.back();
+        cooldown[slot] = cooldown.back();
+        id[slot] = id.back();
+        x.pop_back();
+        y.pop_back();
+        type.pop_back();
+        hp.pop_back();
+        cooldown.pop_back();
+        id.pop_back();
+    }
+};
+
+thread_local EnemyStore enemies;
+thread_local vector<int> enemySlot;    // Id -> slot in enemies, -1 once dead
+thread_local vector<int> freeEnemyIds;
+thread_local vector<int> enemyAt;      // Cell -> id of the enemy there, -1 if none
 
 // Power-up types
 enum PowerupType {
@@ -89,883 +434,4840 @@ map<char, string> symbolDescriptions = {
 };
 
 // Player status effects
-int player1SpeedBoost = 0;
-int player2SpeedBoost = 0;
-int player1Invincibility = 0;
-int player2Invincibility = 0;
+thread_local int player1SpeedBoost = 0;
+thread_local int player2SpeedBoost = 0;
+thread_local int player1Invincibility = 0;
+thread_local int player2Invincibility = 0;
+
+// Foreground and background of each color pair. ncurses numbers its colors
+// the way ANSI escapes do, so the raw renderer uses the same table.
+const short COLOR_PAIR_COLORS[][2] = {
+    {COLOR_WHITE, COLOR_BLACK},   // 0, the terminal's default
+    {COLOR_GREEN, COLOR_BLACK},   // COLOR_PLAYER1
+    {COLOR_BLUE, COLOR_BLACK},    // COLOR_PLAYER2
+    {COLOR_RED, COLOR_BLACK},     // COLOR_ENEMY
+    {COLOR_MAGENTA, COLOR_BLACK}, // COLOR_POWERUP
+    {COLOR_CYAN, COLOR_BLACK},    // COLOR_SAFE
+    {COLOR_WHITE, COLOR_BLACK},   // COLOR_WALL
+    {COLOR_CYAN, COLOR_BLACK},    // COLOR_WATER
+    {COLOR_YELLOW, COLOR_RED},    // COLOR_LAVA
+    {COLOR_YELLOW, COLOR_BLACK},  // COLOR_WEAPON
+    {COLOR_WHITE, COLOR_BLUE},    // COLOR_ARMOR
+    {COLOR_BLACK, COLOR_RED},     // COLOR_TRAP
+    {COLOR_RED, COLOR_YELLOW},    // COLOR_BOSS
+};
 
-void initNCurses() {
-    initscr();
+// Color pairs for every symbol, needs an active screen
+void initColors() {
     start_color();
-    cbreak();
-    noecho();
-    keypad(stdscr, TRUE);
-    nodelay(stdscr, TRUE);
-    curs_set(0);
-    
-    // Initialize color pairs
-    init_pair(COLOR_PLAYER1, COLOR_GREEN, COLOR_BLACK);
-    init_pair(COLOR_PLAYER2, COLOR_BLUE, COLOR_BLACK);
-    init_pair(COLOR_ENEMY, COLOR_RED, COLOR_BLACK);
-    init_pair(COLOR_POWERUP, COLOR_MAGENTA, COLOR_BLACK);
-    init_pair(COLOR_SAFE, COLOR_CYAN, COLOR_BLACK);
-    init_pair(COLOR_WALL, COLOR_WHITE, COLOR_BLACK);
-    init_pair(COLOR_WATER, COLOR_CYAN, COLOR_BLACK);
-    init_pair(COLOR_LAVA, COLOR_YELLOW, COLOR_RED);
-    init_pair(COLOR_WEAPON, COLOR_YELLOW, COLOR_BLACK);
-    init_pair(COLOR_ARMOR, COLOR_WHITE, COLOR_BLUE);
-    init_pair(COLOR_TRAP, COLOR_BLACK, COLOR_RED);
-    init_pair(COLOR_BOSS, COLOR_RED, COLOR_YELLOW);
+    for (int pair = 1; pair < (int)size(COLOR_PAIR_COLORS); ++pair) {
+        init_pair(pair, COLOR_PAIR_COLORS[pair][0], COLOR_PAIR_COLORS[pair][1]);
+    }
+}
+
+// Storage for noise rows. 32-byte alignment plus rows padded to 8 floats lets
+// the compiler use aligned vector loads across a whole row.
+template <typename T>
+struct AlignedAllocator {
+    using value_type = T;
+    static constexpr size_t ALIGNMENT = 32;
+
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), align_val_t(ALIGNMENT))); }
+    void deallocate(T* p, size_t) { ::operator delete(p, align_val_t(ALIGNMENT)); }
+    template <typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+// Calls f(j) for j in [0, n), eight at a time. -O2 won't vectorize a loop that
+// needs a scalar epilogue, but once the eight lanes are unrolled it packs them
+// into vector instructions (with __restrict rows so it can prove no overlap).
+const int NOISE_LANES = 8;
+
+template <typename F>
+inline void forEachLane(int n, F f) {
+    int j = 0;
+    for (; j + NOISE_LANES <= n; j += NOISE_LANES) {
+        #pragma GCC unroll 8
+        for (int lane = 0; lane < NOISE_LANES; ++lane) f(j + lane);
+    }
+    for (; j < n; ++j) f(j);
 }
 
-void endNCurses() {
-    endwin();
+// Row-major floats, every row starting on an aligned boundary
+struct NoiseGrid {
+    int rows = 0, cols = 0, stride = 0;
+    vector<float, AlignedAllocator<float>> data;
+
+    // Contents are left unspecified, every writer below overwrites them
+    void resize(int r, int c) {
+        rows = r;
+        cols = c;
+        stride = (c + 7) & ~7;
+        data.resize((size_t)r * stride);
+    }
+    float* row(int x) { return data.data() + (size_t)x * stride; }
+    const float* row(int x) const { return data.data() + (size_t)x * stride; }
+    float at(int x, int y) const { return data[(size_t)x * stride + y]; }
+};
+
+// Value in [0, 1) for a lattice point. Only depends on the seed and world
+// coordinates, so noise for any region matches its neighbors exactly.
+float latticeValue(uint32_t seed, int x, int y) {
+    uint32_t h = seed ^ (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return (h >> 8) * (1.0f / 16777216.0f);
 }
 
-void clearScreen() {
-    clear();
+float smoothStep(float t) {
+    return t * t * (3.0f - 2.0f * t);
 }
 
-// Adds perlin-like noise for terrain generation
-vector<vector<float>> generateSimpleNoise(int width, int height) {
-    vector<vector<float>> noise(width, vector<float>(height, 0));
-    uniform_real_distribution<float> dist(0.0f, 1.0f);
-    
-    // Generate random values
-    for (int i = 0; i < width; i++) {
-        for (int j = 0; j < height; j++) {
-            noise[i][j] = dist(rng);
+// Adds one octave of value noise over world cells [top, top + rows) x
+// [left, left + cols) with lattice points every period cells, or overwrites
+// out with it if it is the first octave. Separable: each lattice row is
+// interpolated across the columns first, then every output row is a blend of
+// two of those, which is a plain vector loop.
+thread_local vector<float> octaveLattice;
+thread_local vector<int> octaveColumn; // Lattice column left of each output column
+thread_local vector<float> octaveWeight;
+thread_local NoiseGrid octaveRows;
+
+void addValueNoiseOctave(NoiseGrid& out, uint32_t seed, int top, int left, int period, float amplitude, bool first) {
+    auto floorDiv = [](int a, int b) { return a >= 0 ? a / b : -((-a + b - 1) / b); };
+    int latticeTop = floorDiv(top, period), latticeLeft = floorDiv(left, period);
+    int latticeRows = floorDiv(top + out.rows - 1, period) - latticeTop + 2;
+    int latticeCols = floorDiv(left + out.cols - 1, period) - latticeLeft + 2;
+
+    octaveColumn.resize(out.cols);
+    octaveWeight.resize(out.cols);
+    for (int j = 0; j < out.cols; ++j) {
+        int y = left + j;
+        int cell = floorDiv(y, period);
+        octaveColumn[j] = cell - latticeLeft;
+        octaveWeight[j] = smoothStep((y - cell * period) / (float)period);
+    }
+
+    octaveLattice.resize(latticeCols);
+    octaveRows.resize(latticeRows, out.cols);
+    for (int lx = 0; lx < latticeRows; ++lx) {
+        for (int ly = 0; ly < latticeCols; ++ly) {
+            octaveLattice[ly] = latticeValue(seed, latticeTop + lx, latticeLeft + ly);
         }
+        float* __restrict dst = octaveRows.row(lx);
+        const float* lattice = octaveLattice.data();
+        const int* column = octaveColumn.data();
+        const float* weight = octaveWeight.data();
+        forEachLane(out.cols, [&](int j) {
+            float a = lattice[column[j]], b = lattice[column[j] + 1];
+            dst[j] = a + (b - a) * weight[j];
+        });
     }
-    
-    // Simple smoothing
-    vector<vector<float>> smoothed(width, vector<float>(height, 0));
-    for (int i = 0; i < width; i++) {
-        for (int j = 0; j < height; j++) {
-            float sum = 0;
-            int count = 0;
-            
-            for (int di = -1; di <= 1; di++) {
-                for (int dj = -1; dj <= 1; dj++) {
-                    int ni = i + di;
-                    int nj = j + dj;
-                    
-                    if (ni >= 0 && ni < width && nj >= 0 && nj < height) {
-                        sum += noise[ni][nj];
-                        count++;
-                    }
-                }
-            }
-            
-            smoothed[i][j] = sum / count;
+
+    for (int i = 0; i < out.rows; ++i) {
+        int x = top + i;
+        int cell = floorDiv(x, period);
+        float t = smoothStep((x - cell * period) / (float)period);
+        const float* __restrict a = octaveRows.row(cell - latticeTop);
+        const float* __restrict b = octaveRows.row(cell - latticeTop + 1);
+        float* __restrict dst = out.row(i);
+        if (first) {
+            forEachLane(out.cols, [&](int j) { dst[j] = amplitude * (a[j] + (b[j] - a[j]) * t); });
+        } else {
+            forEachLane(out.cols, [&](int j) { dst[j] += amplitude * (a[j] + (b[j] - a[j]) * t); });
         }
     }
-    
-    return smoothed;
 }
 
-bool valid(int x, int y, bool isGhost = false) {
-    return x >= 0 && y >= 0 && x < N && y < N && (isGhost || grid[x][y] != '#');
-}
+// Box blur of src into dst, which must be 2 * radius smaller on each axis,
+// with every result multiplied by scale. Rows and columns are separate passes
+// of straight adds with no edge checks, and a row fits in L1.
+thread_local NoiseGrid blurRows;
 
-void generateTerrain() {
-    vector<vector<float>> noise = generateSimpleNoise(N, N);
-    
-    for (int i = 0; i < N; i++) {
-        for (int j = 0; j < N; j++) {
-            if (noise[i][j] < 0.2) {
-                terrainGrid[i][j] = '~'; // Water
-            } else if (noise[i][j] > 0.85) {
-                terrainGrid[i][j] = '%'; // Lava
-            } else {
-                terrainGrid[i][j] = '.'; // Normal ground
-            }
+void boxBlur(const NoiseGrid& src, NoiseGrid& dst, int radius, float scale = 1.0f) {
+    int taps = 2 * radius + 1;
+    blurRows.resize(src.rows, src.cols - 2 * radius);
+    for (int i = 0; i < src.rows; ++i) {
+        const float* __restrict in = src.row(i);
+        float* __restrict out = blurRows.row(i);
+        forEachLane(blurRows.cols, [&](int j) { out[j] = in[j]; });
+        for (int k = 1; k < taps; ++k) {
+            forEachLane(blurRows.cols, [&](int j) { out[j] += in[j + k]; });
         }
     }
-}
 
-void generateObstacles(int count) {
-    uniform_int_distribution<int> positionDist(0, N-1);
-    
-    int attempts = 0;
-    while (count > 0 && attempts < 1000) {
-        attempts++;
-        int x = positionDist(rng);
-        int y = positionDist(rng);
-        
-        // Check if this is a valid place for an obstacle
-        if (grid[x][y] == '.' && 
-            (abs(x - player1.first) > 3 || abs(y - player1.second) > 3) &&
-            (abs(x - safePoint.first) > 3 || abs(y - safePoint.second) > 3)) {
-            grid[x][y] = '#';
-            count--;
+    dst.resize(src.rows - 2 * radius, blurRows.cols);
+    scale /= taps * taps;
+    for (int i = 0; i < dst.rows; ++i) {
+        float* __restrict out = dst.row(i);
+        const float* __restrict in = blurRows.row(i);
+        forEachLane(dst.cols, [&](int j) { out[j] = in[j]; });
+        for (int k = 1; k < taps - 1; ++k) {
+            in = blurRows.row(i + k);
+            forEachLane(dst.cols, [&](int j) { out[j] += in[j]; });
         }
+        in = blurRows.row(i + taps - 1);
+        forEachLane(dst.cols, [&](int j) { out[j] = (out[j] + in[j]) * scale; });
     }
 }
 
-void generatePowerups() {
-    uniform_int_distribution<int> positionDist(0, N-1);
-    uniform_int_distribution<int> typeDist(0, 4); // Different powerup types
-    
-    // Generate various powerups
-    int powerupCount = 3 + level / 2; // More powerups in higher levels
-    int attempts = 0;
+// Multi-octave value noise in [0, 1) for world cells [top, top + rows) x
+// [left, left + cols), smoothed by a box blur of blurRadius. Each octave halves
+// the lattice period and the amplitude. The blur reads a margin of real noise
+// around the region, so chunks generated separately line up seamlessly.
+thread_local NoiseGrid noiseMargin;
+
+void generateNoise(NoiseGrid& out, uint32_t seed, int top, int left, int rows, int cols,
+                   int octaves = 4, int period = 16, int blurRadius = 1) {
+    NoiseGrid& raw = blurRadius > 0 ? noiseMargin : out;
+    raw.resize(rows + 2 * blurRadius, cols + 2 * blurRadius);
+
+    float amplitude = 1.0f, total = 0.0f;
+    for (int octave = 0; octave < octaves && period > 0; ++octave) {
+        addValueNoiseOctave(raw, seed + octave * 0x9e3779b9u, top - blurRadius, left - blurRadius,
+                            period, amplitude, octave == 0);
+        total += amplitude;
+        amplitude *= 0.5f;
+        period /= 2;
+    }
+
+    // Normalizing rides along with the blur's final pass
+    if (blurRadius > 0) {
+        boxBlur(raw, out, blurRadius, 1.0f / total);
+    } else {
+        for (float& v : raw.data) v /= total;
+    }
+}
+
+bool valid(const BitPlane& walls, int x, int y, bool isGhost) {
+    return (unsigned)x < (unsigned)walls.rows && (unsigned)y < (unsigned)walls.cols &&
+           (isGhost || !walls.test(x, y));
+}
+
+bool valid(int x, int y, bool isGhost = false) {
+    return valid(mapBits.walls, x, y, isGhost);
+}
+
+// Floor with nothing on it
+bool isFree(int x, int y) {
+    return !mapBits.occupied.test(x, y);
+}
+
+// Cells changed since the last frame, so printGrid() only redraws those.
+// While fullRedraw is set (new level, load, scroll) nothing is recorded.
+thread_local vector<int> dirtyCells;
+thread_local vector<char> dirtyFlags;
+thread_local bool fullRedraw = true;
+
+void markDirty(int x, int y) {
+    if (fullRedraw) return;
     
-    while (powerupCount > 0 && attempts < 1000) {
-        attempts++;
-        int x = positionDist(rng);
-        int y = positionDist(rng);
-        
-        if (grid[x][y] == '.') {
-            PowerupType type = static_cast<PowerupType>(typeDist(rng));
-            
-            switch(type) {
-                case HEALTH:
-                    grid[x][y] = '+';
-                    break;
-                case SPEED:
-                    grid[x][y] = 'S';
-                    break;
-                case INVINCIBILITY:
-                    grid[x][y] = 'I';
-                    break;
-                case WEAPON:
-                    grid[x][y] = '>';
-                    break;
-                case ARMOR:
-                    grid[x][y] = 'A';
-                    break;
-            }
-            powerupCount--;
-        }
+    int idx = grid.index(x, y);
+    if (!dirtyFlags[idx]) {
+        dirtyFlags[idx] = 1;
+        dirtyCells.push_back(idx);
+    }
+}
+
+void clearDirtyCells() {
+    if (fullRedraw) {
+        dirtyFlags.assign(grid.cells.size(), 0);
+    } else {
+        for (int idx : dirtyCells) dirtyFlags[idx] = 0;
+    }
+    dirtyCells.clear();
+    fullRedraw = false;
+}
+
+void clearEnemies() {
+    enemies.clear();
+    enemySlot.clear();
+    freeEnemyIds.clear();
+    enemyAt.assign(grid.cells.size(), -1);
+}
+
+int enemyIdAt(int x, int y) {
+    return enemyAt[grid.index(x, y)];
+}
+
+// Adds an enemy to the list and the occupancy index, returning its id.
+// The caller draws its symbol.
+int spawnEnemy(int x, int y, int type) {
+    int id;
+    if (!freeEnemyIds.empty()) {
+        id = freeEnemyIds.back();
+        freeEnemyIds.pop_back();
+    } else {
+        id = enemySlot.size();
+        enemySlot.push_back(-1);
     }
     
-    // Add some traps
-    int trapCount = level;
-    attempts = 0;
+    enemySlot[id] = enemies.size();
+    enemies.push(x, y, type, ENEMY_HIT_POINTS[type], 0, id);
+    enemyAt[grid.index(x, y)] = id;
+    return id;
+}
+
+// Removes an enemy by moving the last one into its slot
+void removeEnemy(int id) {
+    int slot = enemySlot[id];
+    enemyAt[grid.index(enemies.x[slot], enemies.y[slot])] = -1;
     
-    while (trapCount > 0 && attempts < 500) {
-        attempts++;
-        int x = positionDist(rng);
-        int y = positionDist(rng);
-        
-        if (grid[x][y] == '.' && 
-           (abs(x - player1.first) > 5 || abs(y - player1.second) > 5) &&
-           (abs(x - safePoint.first) > 5 || abs(y - safePoint.second) > 5)) {
-            grid[x][y] = 'T';
-            trapCount--;
-        }
+    enemies.swapRemove(slot);
+    if (slot < (int)enemies.size()) enemySlot[enemies.id[slot]] = slot;
+    
+    enemySlot[id] = -1;
+    freeEnemyIds.push_back(id);
+}
+
+void moveEnemy(int slot, int x, int y) {
+    enemyAt[grid.index(enemies.x[slot], enemies.y[slot])] = -1;
+    enemies.x[slot] = x;
+    enemies.y[slot] = y;
+    enemyAt[grid.index(x, y)] = enemies.id[slot];
+}
+
+// Re-creates ids and the occupancy index after enemies was filled directly,
+// keeping each enemy's hit points and cooldown
+void rebuildEnemyIndex() {
+    EnemyStore loaded = move(enemies);
+    clearEnemies();
+    for (size_t i = 0; i < loaded.size(); ++i) {
+        int x = loaded.x[i], y = loaded.y[i];
+        if (!grid.inBounds(x, y) || enemyAt[grid.index(x, y)] >= 0) continue;
+        int slot = enemySlot[spawnEnemy(x, y, loaded.type[i])];
+        enemies.hp[slot] = loaded.hp[i];
+        enemies.cooldown[slot] = loaded.cooldown[i];
     }
 }
 
-void generateSafePoint() {
-    uniform_int_distribution<int> positionDist(0, N-1);
+// Cluster hierarchy used for pathfinding on big maps, see buildHierarchy()
+const int CLUSTER_SIZE = 16;
+thread_local bool hierarchyStale = true;     // Rebuild all clusters before the next query
+thread_local vector<char> clusterDirty;      // Rebuild just these before the next query
+thread_local vector<int> dirtyClusterList;
+thread_local unsigned wallVersion = 0; // Bumped whenever walls change, older paths may cross new walls
+
+// A wall appeared or vanished at (x, y). Its cluster's inner paths change, and
+// if it is on the cluster's edge so do the entrances shared with the neighbor.
+void markWallChanged(int x, int y) {
+    if (hierarchyStale || clusterDirty.empty()) return;
+    int clusterRows = (grid.rows + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    int clusterCols = (grid.cols + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    int cx = x / CLUSTER_SIZE, cy = y / CLUSTER_SIZE;
+    bool onEdge[4] = {x % CLUSTER_SIZE == 0, x % CLUSTER_SIZE == CLUSTER_SIZE - 1,
+                      y % CLUSTER_SIZE == 0, y % CLUSTER_SIZE == CLUSTER_SIZE - 1};
     
-    while (true) {
-        int x = positionDist(rng);
-        int y = positionDist(rng);
+    for (int i = -1; i < 4; ++i) {
+        if (i >= 0 && !onEdge[i]) continue;
+        int nx = cx + (i < 0 ? 0 : dx[i]), ny = cy + (i < 0 ? 0 : dy[i]);
+        if (nx < 0 || nx >= clusterRows || ny < 0 || ny >= clusterCols) continue;
         
-        // Place safe point far from players
-        if (grid[x][y] == '.' && 
-           (abs(x - player1.first) > N/2 || abs(y - player1.second) > N/2) &&
-           (!multiplayer || abs(x - player2.first) > N/2 || abs(y - player2.second) > N/2)) {
-            safePoint = {x, y};
-            grid[x][y] = 'X';
-            break;
+        int cluster = nx * clusterCols + ny;
+        if (!clusterDirty[cluster]) {
+            clusterDirty[cluster] = 1;
+            dirtyClusterList.push_back(cluster);
         }
     }
 }
 
-void setupLevel() {
-    // Reset the grid
-    for (int i = 0; i < N; ++i) {
-        for (int j = 0; j < N; ++j) {
-            grid[i][j] = '.';
+// What each map symbol is, as TILE_* bits. Walls block everything but
+// enemies that go through them.
+enum TileClass : uint8_t { TILE_WALL = 1, TILE_ENEMY = 2, TILE_PICKUP = 4, TILE_TRAP = 8 };
+
+constexpr array<uint8_t, 256> TILE_CLASSES = [] {
+    array<uint8_t, 256> table{};
+    table['#'] = TILE_WALL;
+    table['T'] = TILE_TRAP;
+    for (char c : {'+', 'S', 'I', '>', 'A'}) table[(uint8_t)c] = TILE_PICKUP;
+    for (char c : ENEMY_SYMBOLS) table[(uint8_t)c] = TILE_ENEMY;
+    return table;
+}();
+
+uint8_t tileClass(char c) {
+    return TILE_CLASSES[(uint8_t)c];
+}
+
+bool isEnemySymbol(char c) {
+    return tileClass(c) & TILE_ENEMY;
+}
+
+bool isPickupSymbol(char c) {
+    return tileClass(c) & TILE_PICKUP;
+}
+
+// Free cells (floor with nothing on it) are the zero bits of
+// mapBits.occupied, whose row padding is kept set. freeCounts is a Fenwick
+// tree over how many each word of that plane holds, so a uniformly random
+// free cell is a walk down the tree to its word and a bit select, all within
+// a few cache-sized arrays.
+thread_local vector<int> freeCounts; // 1-based, one entry per word, padded to a power of two
+thread_local int freeCellCount = 0;
+
+uint64_t freeBits(size_t word) {
+    return ~mapBits.occupied.bits[word];
+}
+
+// Position of the k-th set bit of v: count bits per byte, find the byte from
+// the running totals, then step through it
+int selectBit(uint64_t v, int k) {
+    uint64_t c = v - ((v >> 1) & 0x5555555555555555ULL);
+    c = (c & 0x3333333333333333ULL) + ((c >> 2) & 0x3333333333333333ULL);
+    c = (c + (c >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    uint64_t totals = c * 0x0101010101010101ULL; // Byte i holds the count of bytes 0..i
+    int byte = 0;
+    while ((int)(totals >> (byte * 8) & 0xff) <= k) ++byte;
+    if (byte > 0) k -= totals >> ((byte - 1) * 8) & 0xff;
+    uint64_t bits = v >> (byte * 8);
+    for (; k > 0; --k) bits &= bits - 1;
+    return byte * 8 + __builtin_ctzll(bits);
+}
+
+void adjustFreeCount(size_t word, int delta) {
+    for (size_t i = word + 1; i < freeCounts.size(); i += i & -i) freeCounts[i] += delta;
+    freeCellCount += delta;
+}
+
+// Grid index of free cell k, counting in row-major order from 0
+int nthFreeCell(int k) {
+    const int* counts = freeCounts.data();
+    size_t word = 0;
+    for (size_t step = (freeCounts.size() - 1) / 2; step > 0; step /= 2) {
+        int count = counts[word + step];
+        bool skip = count <= k; // Free cell k lies past this node's words
+        word += skip ? step : 0;
+        k -= skip ? count : 0;
+    }
+    const BitPlane& occupied = mapBits.occupied;
+    int bit = selectBit(freeBits(word), k);
+    return (int)(word / occupied.words) * occupied.cols + (int)(word % occupied.words) * 64 + bit;
+}
+
+// Uniformly random free cell. While a quarter of the map or more is free,
+// probing random cells finds one in a few tries, which is cheaper than a walk
+// down the tree; crowded maps, or a run of bad luck, use the tree.
+int randomFreeCell() {
+    int cells = grid.rows * grid.cols;
+    if (freeCellCount * 4 >= cells) {
+        uniform_int_distribution<int> anyCell(0, cells - 1);
+        for (int t = 0; t < 16; ++t) {
+            int c = anyCell(rng);
+            if (isFree(c / grid.cols, c % grid.cols)) return c;
         }
     }
-    
-    // Generate terrain first
-    generateTerrain();
-    
-    // Setup players
-    player1 = {0, 0};
-    grid[player1.first][player1.second] = '1';
-    
-    if (multiplayer) {
-        player2 = {0, N - 1};
-        grid[player2.first][player2.second] = '2';
+    return nthFreeCell(uniform_int_distribution<int>(0, freeCellCount - 1)(rng));
+}
+
+// Calls f(cell) for every free cell in row-major order
+template <typename F>
+void forEachFreeCell(F f) {
+    const BitPlane& occupied = mapBits.occupied;
+    for (size_t word = 0; word < occupied.bits.size(); ++word) {
+        int base = (int)(word / occupied.words) * occupied.cols + (int)(word % occupied.words) * 64;
+        for (uint64_t bits = freeBits(word); bits; bits &= bits - 1) f(base + __builtin_ctzll(bits));
     }
-    
-    // Add safe point before adding enemies and obstacles
-    generateSafePoint();
-    
-    // Add obstacles
-    generateObstacles(15 + 5 * level);
-    
-    // Add enemies with different types
-    enemies.clear();
-    uniform_int_distribution<int> positionDist(0, N-1);
-    uniform_int_distribution<int> typeDist(0, 100);
-    
-    // Calculate enemy distribution based on level
-    int normalEnemies = level;
-    int wandererEnemies = level / 2;
-    int hunterEnemies = level / 3;
-    int ghostEnemies = level / 4;
-    int bossEnemies = (level % 5 == 0) ? 1 : 0; // Boss every 5 levels
-    
-    // Add normal enemies
-    for (int i = 0; i < normalEnemies; ++i) {
-        int attempts = 0;
-        while (attempts < 100) {
-            int ex = positionDist(rng), ey = positionDist(rng);
-            if (grid[ex][ey] == '.' && 
-               (abs(ex - player1.first) > 5 || abs(ey - player1.second) > 5) &&
-               (!multiplayer || abs(ex - player2.first) > 5 || abs(ey - player2.second) > 5)) {
-                enemies.emplace_back(ex, ey, NORMAL);
-                grid[ex][ey] = 'E';
-                break;
-            }
-            attempts++;
+}
+
+// Rebuilds every plane and the free cell counts from grid and terrainGrid,
+// after a level is generated or loaded
+void rebuildMapBits() {
+    MapBits& b = mapBits;
+    for (BitPlane* plane : {&b.walls, &b.enemies, &b.pickups, &b.traps, &b.water, &b.lava, &b.occupied}) {
+        plane->resize(grid.rows, grid.cols);
+    }
+    for (int x = 0; x < grid.rows; ++x) {
+        for (int y = 0; y < grid.cols; ++y) {
+            char c = grid.at(x, y), t = terrainGrid.at(x, y);
+            uint8_t cls = tileClass(c);
+            size_t w = (size_t)x * b.walls.words + (y >> 6);
+            uint64_t bit = 1ULL << (y & 63);
+            if (cls & TILE_WALL) b.walls.bits[w] |= bit;
+            if (cls & TILE_ENEMY) b.enemies.bits[w] |= bit;
+            if (cls & TILE_PICKUP) b.pickups.bits[w] |= bit;
+            if (cls & TILE_TRAP) b.traps.bits[w] |= bit;
+            if (c != '.') b.occupied.bits[w] |= bit;
+            if (t == '~') b.water.bits[w] |= bit;
+            if (t == '%') b.lava.bits[w] |= bit;
         }
     }
-    
-    // Add wanderer enemies
-    for (int i = 0; i < wandererEnemies; ++i) {
-        int attempts = 0;
-        while (attempts < 100) {
-            int ex = positionDist(rng), ey = positionDist(rng);
-            if (grid[ex][ey] == '.' && 
-               (abs(ex - player1.first) > 5 || abs(ey - player1.second) > 5) &&
-               (!multiplayer || abs(ex - player2.first) > 5 || abs(ey - player2.second) > 5)) {
-                enemies.emplace_back(ex, ey, WANDERER);
-                grid[ex][ey] = 'W';
-                break;
-            }
-            attempts++;
+
+    for (int x = 0; x < grid.rows; ++x) {
+        b.occupied.row(x)[b.occupied.words - 1] |= ~b.occupied.wordMask(b.occupied.words - 1);
+    }
+    size_t words = b.occupied.bits.size(), size = 1;
+    while (size < words) size *= 2;
+    freeCounts.assign(size + 1, 0);
+    freeCellCount = 0;
+    for (size_t i = 1; i <= size; ++i) {
+        int count = i <= words ? __builtin_popcountll(freeBits(i - 1)) : 0;
+        freeCellCount += count;
+        freeCounts[i] += count;
+        size_t parent = i + (i & -i);
+        if (parent <= size) freeCounts[parent] += freeCounts[i];
+    }
+}
+
+// Writes a tile and its bits, for level generation
+void placeTile(int x, int y, char symbol) {
+    grid.at(x, y) = symbol;
+    uint8_t cls = tileClass(symbol);
+    mapBits.walls.set(x, y, cls & TILE_WALL);
+    mapBits.enemies.set(x, y, cls & TILE_ENEMY);
+    mapBits.pickups.set(x, y, cls & TILE_PICKUP);
+    mapBits.traps.set(x, y, cls & TILE_TRAP);
+    if (mapBits.occupied.test(x, y) != (symbol != '.')) {
+        mapBits.occupied.set(x, y, symbol != '.');
+        adjustFreeCount((size_t)x * mapBits.occupied.words + (y >> 6), symbol == '.' ? 1 : -1);
+    }
+}
+
+// Changes a tile during play and schedules it for redrawing
+void setTile(int x, int y, char symbol) {
+    if (mapBits.walls.test(x, y) != bool(tileClass(symbol) & TILE_WALL)) {
+        markWallChanged(x, y);
+        ++wallVersion;
+    }
+    placeTile(x, y, symbol);
+    markDirty(x, y);
+}
+
+// Fills one row of a flood: every open run holding a bit of r is set
+// completely. Runs continue across words, so the fill goes up the row and
+// back down carrying the edge bit between words.
+void fillRow(uint64_t* r, const uint64_t* open, int words) {
+    uint64_t carry = 0;
+    for (int w = 0; w < words; ++w) {
+        uint64_t g = r[w] | (carry & open[w]), p = open[w];
+        for (int shift = 1; shift < 64; shift *= 2) {
+            g |= p & (g << shift);
+            p &= p << shift;
         }
+        r[w] = g;
+        carry = g >> 63;
     }
-    
-    // Add hunter enemies
-    for (int i = 0; i < hunterEnemies; ++i) {
-        int attempts = 0;
-        while (attempts < 100) {
-            int ex = positionDist(rng), ey = positionDist(rng);
-            if (grid[ex][ey] == '.' && 
-               (abs(ex - player1.first) > 7 || abs(ey - player1.second) > 7) &&
-               (!multiplayer || abs(ex - player2.first) > 7 || abs(ey - player2.second) > 7)) {
-                enemies.emplace_back(ex, ey, HUNTER);
-                grid[ex][ey] = 'H';
-                break;
-            }
-            attempts++;
+    carry = 0;
+    for (int w = words - 1; w >= 0; --w) {
+        uint64_t g = r[w] | ((carry << 63) & open[w]), p = open[w];
+        for (int shift = 1; shift < 64; shift *= 2) {
+            g |= p & (g >> shift);
+            p &= p >> shift;
         }
+        r[w] = g;
+        carry = g & 1;
     }
-    
-    // Add ghost enemies
-    for (int i = 0; i < ghostEnemies; ++i) {
-        int attempts = 0;
-        while (attempts < 100) {
-            int ex = positionDist(rng), ey = positionDist(rng);
-            if (grid[ex][ey] == '.' && 
-               (abs(ex - player1.first) > 7 || abs(ey - player1.second) > 7) &&
-               (!multiplayer || abs(ex - player2.first) > 7 || abs(ey - player2.second) > 7)) {
-                enemies.emplace_back(ex, ey, GHOST);
-                grid[ex][ey] = 'G';
-                break;
-            }
-            attempts++;
+}
+
+thread_local vector<uint64_t> floodOpen;
+
+// Cells reachable from src in four directions without entering a blocked
+// cell, as bit-parallel frontier expansion: each row fills along its open runs
+// and spills into the rows next to it, sweeping down and back up until a
+// round changes nothing.
+void floodFill(BitPlane& out, pair<int, int> src, const BitPlane& blocked) {
+    out.resize(blocked.rows, blocked.cols);
+    int words = blocked.words;
+    floodOpen.resize(words);
+
+    auto loadOpen = [&](int x) {
+        for (int w = 0; w < words; ++w) floodOpen[w] = ~blocked.row(x)[w] & blocked.wordMask(w);
+    };
+    // Pulls in open cells next to the rows above and below, true if x grew
+    auto spread = [&](int x) {
+        loadOpen(x);
+        uint64_t* r = out.row(x);
+        bool grew = false;
+        for (int w = 0; w < words; ++w) {
+            uint64_t seed = r[w];
+            if (x > 0) seed |= out.row(x - 1)[w] & floodOpen[w];
+            if (x + 1 < out.rows) seed |= out.row(x + 1)[w] & floodOpen[w];
+            if (seed != r[w]) grew = true;
+            r[w] = seed;
         }
+        if (grew) fillRow(r, floodOpen.data(), words);
+        return grew;
+    };
+
+    out.set(src.first, src.second, true);
+    loadOpen(src.first);
+    fillRow(out.row(src.first), floodOpen.data(), words);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int x = 0; x < out.rows; ++x) changed |= spread(x);
+        for (int x = out.rows - 1; x >= 0; --x) changed |= spread(x);
     }
+}
+
+thread_local NoiseGrid terrainNoise;
+
+void generateTerrain() {
+    generateNoise(terrainNoise, rng(), 0, 0, grid.rows, grid.cols);
     
-    // Add boss enemy
-    if (bossEnemies > 0) {
-        int attempts = 0;
-        while (attempts < 100) {
-            int ex = positionDist(rng), ey = positionDist(rng);
-            if (grid[ex][ey] == '.' && 
-               (abs(ex - player1.first) > 10 || abs(ey - player1.second) > 10) &&
-               (!multiplayer || abs(ex - player2.first) > 10 || abs(ey - player2.second) > 10)) {
-                enemies.emplace_back(ex, ey, BOSS);
-                grid[ex][ey] = 'B';
-                break;
+    for (int i = 0; i < grid.rows; i++) {
+        const float* noise = terrainNoise.row(i);
+        for (int j = 0; j < grid.cols; j++) {
+            if (noise[j] < 0.2) {
+                terrainGrid.at(i, j) = '~'; // Water
+            } else if (noise[j] > 0.85) {
+                terrainGrid.at(i, j) = '%'; // Lava
+            } else {
+                terrainGrid.at(i, j) = '.'; // Normal ground
             }
-            attempts++;
         }
     }
-    
-    // Add powerups
-    generatePowerups();
-    
-    // Reset player status effects
-    player1SpeedBoost = 0;
-    player2SpeedBoost = 0;
-    player1Invincibility = 0;
-    player2Invincibility = 0;
 }
 
-void printGrid() {
-    clearScreen();
-    
-    // Draw border
-    for (int j = 0; j < N + 2; j++) {
-        mvaddch(0, j, '*');
-        mvaddch(N + 1, j, '*');
+// Clutter counts are tuned for the original 20x20 map and scale with area
+int areaScale() {
+    return max(1, (grid.rows * grid.cols) / (20 * 20));
+}
+
+// Random free cells tried before listing the allowed ones outright
+const int PLACEMENT_TRIES = 32;
+
+thread_local vector<int> placementScratch;
+
+// Places up to count tiles on free cells that pass allowed(x, y), calling
+// place(x, y) for each, and returns how many were placed. Cells are drawn
+// uniformly from the allowed ones. Once random picks stop finding one, the
+// allowed cells are listed in one scan and the rest are drawn from that
+// list, so a crowded level costs a pass over the map, not endless retries.
+template <typename Allowed, typename Place>
+int placeOnFreeCells(int count, Allowed allowed, Place place) {
+    int placed = 0;
+    while (placed < count && freeCellCount > 0) {
+        int cell = -1;
+        for (int t = 0; t < PLACEMENT_TRIES && cell < 0; ++t) {
+            int c = randomFreeCell();
+            if (allowed(c / grid.cols, c % grid.cols)) cell = c;
+        }
+        if (cell < 0) break;
+        place(cell / grid.cols, cell % grid.cols);
+        placed++;
     }
-    for (int i = 0; i < N + 2; i++) {
-        mvaddch(i, 0, '*');
-        mvaddch(i, N + 1, '*');
+    if (placed == count) return placed;
+
+    placementScratch.clear();
+    forEachFreeCell([&](int c) {
+        if (allowed(c / grid.cols, c % grid.cols)) placementScratch.push_back(c);
+    });
+    while (placed < count && !placementScratch.empty()) {
+        int k = uniform_int_distribution<int>(0, placementScratch.size() - 1)(rng);
+        int c = placementScratch[k];
+        placementScratch[k] = placementScratch.back();
+        placementScratch.pop_back();
+        if (!isFree(c / grid.cols, c % grid.cols)) continue; // Taken by an earlier place()
+        place(c / grid.cols, c % grid.cols);
+        placed++;
     }
+    return placed;
+}
+
+// Outside the square of the given radius around p
+bool farFrom(int x, int y, pair<int, int> p, int radius) {
+    return abs(x - p.first) > radius || abs(y - p.second) > radius;
+}
+
+void generateObstacles(int count) {
+    placeOnFreeCells(count, [](int x, int y) {
+        return farFrom(x, y, player1, 3) && farFrom(x, y, safePoint, 3);
+    }, [](int x, int y) {
+        placeTile(x, y, '#');
+    });
+}
+
+void generatePowerups() {
+    uniform_int_distribution<int> typeDist(0, 4); // Different powerup types
     
-    // Draw grid
-    for (int i = 0; i < N; ++i) {
-        for (int j = 0; j < N; ++j) {
-            char displayChar = grid[i][j];
-            if (displayChar == '.') {
-                displayChar = terrainGrid[i][j];
-            }
-            
-            // Set color based on character
-            switch (displayChar) {
-                case '1':
-                    attron(COLOR_PAIR(COLOR_PLAYER1));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_PLAYER1));
-                    break;
-                case '2':
-                    attron(COLOR_PAIR(COLOR_PLAYER2));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_PLAYER2));
-                    break;
-                case 'E':
-                    attron(COLOR_PAIR(COLOR_ENEMY));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_ENEMY));
-                    break;
-                case 'W':
-                    attron(COLOR_PAIR(COLOR_ENEMY));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_ENEMY));
-                    break;
-                case 'H':
-                    attron(COLOR_PAIR(COLOR_ENEMY));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_ENEMY));
-                    break;
-                case 'G':
-                    attron(COLOR_PAIR(COLOR_ENEMY) | A_BLINK);
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_ENEMY) | A_BLINK);
-                    break;
-                case 'B':
-                    attron(COLOR_PAIR(COLOR_BOSS));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_BOSS));
-                    break;
-                case '#':
-                    attron(COLOR_PAIR(COLOR_WALL));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_WALL));
-                    break;
-                case '~':
-                    attron(COLOR_PAIR(COLOR_WATER));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_WATER));
-                    break;
-                case '%':
-                    attron(COLOR_PAIR(COLOR_LAVA));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_LAVA));
-                    break;
-                case 'X':
-                    attron(COLOR_PAIR(COLOR_SAFE));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_SAFE));
-                    break;
-                case '+':
-                case 'S':
-                case 'I':
-                    attron(COLOR_PAIR(COLOR_POWERUP));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_POWERUP));
-                    break;
-                case '>':
-                    attron(COLOR_PAIR(COLOR_WEAPON));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_WEAPON));
-                    break;
-                case 'A':
-                    attron(COLOR_PAIR(COLOR_ARMOR));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_ARMOR));
-                    break;
-                case 'T':
-                    attron(COLOR_PAIR(COLOR_TRAP));
-                    mvaddch(i+1, j+1, displayChar);
-                    attroff(COLOR_PAIR(COLOR_TRAP));
-                    break;
-                default:
-                    mvaddch(i+1, j+1, displayChar);
-            }
+    // Generate various powerups
+    int powerupCount = (3 + level / 2) * areaScale(); // More powerups in higher levels
+    placeOnFreeCells(powerupCount, [](int, int) { return true; }, [&](int x, int y) {
+        PowerupType type = static_cast<PowerupType>(typeDist(rng));
+        
+        switch(type) {
+            case HEALTH:
+                placeTile(x, y, '+');
+                break;
+            case SPEED:
+                placeTile(x, y, 'S');
+                break;
+            case INVINCIBILITY:
+                placeTile(x, y, 'I');
+                break;
+            case WEAPON:
+                placeTile(x, y, '>');
+                break;
+            case ARMOR:
+                placeTile(x, y, 'A');
+                break;
+        }
+    });
+    
+    // Add some traps
+    int trapCount = level * areaScale();
+    placeOnFreeCells(trapCount, [](int x, int y) {
+        return farFrom(x, y, player1, 5) && farFrom(x, y, safePoint, 5);
+    }, [](int x, int y) {
+        placeTile(x, y, 'T');
+    });
+}
+
+void generateSafePoint() {
+    int farRows = grid.rows / 2, farCols = grid.cols / 2;
+    
+    // Place safe point far from players
+    int placed = placeOnFreeCells(1, [&](int x, int y) {
+        return (abs(x - player1.first) > farRows || abs(y - player1.second) > farCols) &&
+               (!multiplayer || abs(x - player2.first) > farRows || abs(y - player2.second) > farCols);
+    }, [](int x, int y) {
+        safePoint = {x, y};
+        placeTile(x, y, 'X');
+    });
+    if (placed > 0) return;
+    
+    // No cell is that far, settle for the free cell furthest from player 1
+    int best = -1, bestDist = -1;
+    forEachFreeCell([&](int c) {
+        int d = abs(c / grid.cols - player1.first) + abs(c % grid.cols - player1.second);
+        if (d > bestDist) {
+            best = c;
+            bestDist = d;
         }
+    });
+    safePoint = {best / grid.cols, best % grid.cols};
+    placeTile(safePoint.first, safePoint.second, 'X');
+}
+
+thread_local BitPlane levelReach;
+thread_local vector<int> carveDist;
+thread_local vector<int> carveParent;
+
+// Knocks down the fewest walls that join from to the region in levelReach:
+// a 0-1 BFS where entering a wall costs 1, traced back from the first
+// reached cell
+void carveToReach(pair<int, int> from) {
+    size_t cells = grid.cells.size();
+    carveDist.assign(cells, INT_MAX);
+    carveParent.assign(cells, -1);
+    deque<int> queue;
+    int start = grid.index(from.first, from.second);
+    carveDist[start] = 0;
+    queue.push_back(start);
+    
+    int joined = -1;
+    while (!queue.empty()) {
+        int cell = queue.front();
+        queue.pop_front();
+        int x = cell / grid.cols, y = cell % grid.cols;
+        if (levelReach.test(x, y)) {
+            joined = cell;
+            break;
+        }
+        for (int i = 0; i < 4; ++i) {
+            int nx = x + dx[i], ny = y + dy[i];
+            if (!grid.inBounds(nx, ny)) continue;
+            int wall = mapBits.walls.test(nx, ny);
+            int next = grid.index(nx, ny);
+            if (carveDist[cell] + wall >= carveDist[next]) continue;
+            carveDist[next] = carveDist[cell] + wall;
+            carveParent[next] = cell;
+            if (wall) queue.push_back(next);
+            else queue.push_front(next);
+        }
+    }
+    
+    for (int cell = joined; cell >= 0; cell = carveParent[cell]) {
+        int x = cell / grid.cols, y = cell % grid.cols;
+        if (mapBits.walls.test(x, y)) placeTile(x, y, '.');
+    }
+}
+
+// Makes sure the players can walk to the safe point. One flood from the exit
+// covers every player; a player left outside it gets a path carved in.
+void connectExit() {
+    floodFill(levelReach, safePoint, mapBits.walls);
+    for (int p = 0; p < (multiplayer ? 2 : 1); ++p) {
+        pair<int, int> player = p == 0 ? player1 : player2;
+        if (levelReach.test(player.first, player.second)) continue;
+        carveToReach(player);
+        floodFill(levelReach, safePoint, mapBits.walls);
+    }
+}
+
+// Puts count enemies of one type on free cells outside radius of the players
+void placeEnemies(int count, int type, int radius) {
+    placeOnFreeCells(count, [&](int x, int y) {
+        return farFrom(x, y, player1, radius) && (!multiplayer || farFrom(x, y, player2, radius));
+    }, [&](int x, int y) {
+        spawnEnemy(x, y, type);
+        placeTile(x, y, ENEMY_SYMBOLS[type]);
+    });
+}
+
+void setupLevel() {
+    PhaseTimer timer(PHASE_LEVEL);
+    // Reset the grid
+    grid.resize(worldRows, worldCols, '.');
+    terrainGrid.resize(worldRows, worldCols, '.');
+    
+    // Generate terrain first
+    generateTerrain();
+    rebuildMapBits();
+    
+    // Setup players
+    player1 = {0, 0};
+    placeTile(player1.first, player1.second, '1');
+    
+    if (multiplayer) {
+        player2 = {0, grid.cols - 1};
+        placeTile(player2.first, player2.second, '2');
     }
     
-    // Display status
-    mvprintw(N+2, 1, "Level: %d  Score: %d  Time: %d", level, score, gameTime);
-    mvprintw(N+3, 1, "P1: HP:%d ARM:%d WPN:%d", health1, armor1, weapons1);
+    // Add safe point before adding enemies and obstacles
+    generateSafePoint();
+    
+    // Add obstacles, then open a way through them if they cut the exit off
+    generateObstacles((15 + 5 * level) * areaScale());
+    connectExit();
+    
+    // Add enemies with different types
+    clearEnemies();
+    
+    // Each type's policy sets how many the level gets
+    EnemyPolicies::forEach([](auto policy) {
+        using Policy = decltype(policy);
+        placeEnemies(Policy::onLevel(level), Policy::type, Policy::spawnDistance);
+    });
+    
+    // Add powerups
+    generatePowerups();
+    
+    // Reset player status effects
+    player1SpeedBoost = 0;
+    player2SpeedBoost = 0;
+    player1Invincibility = 0;
+    player2Invincibility = 0;
     
-    if (player1SpeedBoost > 0)
-        mvprintw(N+3, 25, "SPEED:%d ", player1SpeedBoost);
-    if (player1Invincibility > 0)
-        mvprintw(N+3, 35, "INVULN:%d ", player1Invincibility);
+    fullRedraw = true;
+    hierarchyStale = true; // Rebuilt on the first enemy tick
+    ++wallVersion;
+}
+
+// Rows below the map used by the status lines, legend and controls
+const int HUD_HEIGHT = 16;
+const int STATUS_HEIGHT = 4;
+
+// Part of the map that is on screen, scrolled to keep a player in view
+int viewRows = 0, viewCols = 0;
+int viewTop = 0, viewLeft = 0;
+int followPlayer = 1; // Player the view scrolls with
+
+string statusMessage;                // Shown after the level line, e.g. save results
+int statusMessageFrames = 0;
+double inputLatencyMs = -1;          // Rolling key-to-screen latency, -1 until measured
+bool profileOverlay = false;         // Toggled with o
+string profileLine;                  // Overlay text, refreshed every PROFILE_REFRESH ticks
+long long profileLineTick = -1;
+const int PROFILE_REFRESH = 10;
+
+// Fits the view into a screen of the given size
+void updateViewport(int lines, int cols) {
+    viewRows = min(grid.rows, max(MIN_WORLD_SIZE, lines - 2 - HUD_HEIGHT));
+    viewCols = min(grid.cols, max(MIN_WORLD_SIZE, cols - 2));
+    pair<int, int> focus = followPlayer == 2 ? player2 : player1;
+    viewTop = clamp(focus.first - viewRows / 2, 0, grid.rows - viewRows);
+    viewLeft = clamp(focus.second - viewCols / 2, 0, grid.cols - viewCols);
+}
+
+void showMessage(const string& message) {
+    statusMessage = message;
+    statusMessageFrames = 2000 / FRAME_MS;
+}
+
+// Color attributes of each symbol on the map
+constexpr array<chtype, 256> SYMBOL_ATTRS = [] {
+    array<chtype, 256> table{};
+    table['1'] = COLOR_PAIR(COLOR_PLAYER1);
+    table['2'] = COLOR_PAIR(COLOR_PLAYER2);
+    table['#'] = COLOR_PAIR(COLOR_WALL);
+    table['~'] = COLOR_PAIR(COLOR_WATER);
+    table['%'] = COLOR_PAIR(COLOR_LAVA);
+    table['X'] = COLOR_PAIR(COLOR_SAFE);
+    table['+'] = table['S'] = table['I'] = COLOR_PAIR(COLOR_POWERUP);
+    table['>'] = COLOR_PAIR(COLOR_WEAPON);
+    table['A'] = COLOR_PAIR(COLOR_ARMOR);
+    table['T'] = COLOR_PAIR(COLOR_TRAP);
+    EnemyPolicies::forEach([&](auto policy) {
+        using Policy = decltype(policy);
+        table[(uint8_t)Policy::symbol] = COLOR_PAIR(Policy::colorPair) | Policy::attrs;
+    });
+    return table;
+}();
+
+chtype symbolAttr(char symbol) {
+    return SYMBOL_ATTRS[(uint8_t)symbol];
+}
+
+string playerStatusLine(int id, int health, int armor, int weapons, int speedBoost, int invincibility) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "P%d: HP:%d ARM:%d WPN:%d", id, health, armor, weapons);
+    string line = buf;
     
+    if (speedBoost > 0) {
+        line.resize(24, ' ');
+        snprintf(buf, sizeof(buf), "SPEED:%d ", speedBoost);
+        line += buf;
+    }
+    if (invincibility > 0) {
+        line.resize(34, ' ');
+        snprintf(buf, sizeof(buf), "INVULN:%d ", invincibility);
+        line += buf;
+    }
+    return line;
+}
+
+// Text of the status lines for this frame, at most width characters of
+// profiler overlay. Counts down the frames a message has left.
+void statusLines(string (&lines)[STATUS_HEIGHT], int width) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "Level: %d  Score: %d  Time: %d", level, score, gameTime);
+    lines[0] = buf;
+    if (inputLatencyMs >= 0) {
+        snprintf(buf, sizeof(buf), "  Lag: %.0fms", inputLatencyMs);
+        lines[0] += buf;
+    }
+    if (statusMessageFrames > 0) {
+        statusMessageFrames--;
+        lines[0].resize(max<size_t>(lines[0].size() + 2, 40), ' ');
+        lines[0] += statusMessage;
+    }
+    lines[1] = playerStatusLine(1, health1, armor1, weapons1, player1SpeedBoost, player1Invincibility);
+    lines[2].clear();
     if (multiplayer) {
-        mvprintw(N+4, 1, "P2: HP:%d ARM:%d WPN:%d", health2, armor2, weapons2);
-        if (player2SpeedBoost > 0)
-            mvprintw(N+4, 25, "SPEED:%d ", player2SpeedBoost);
-        if (player2Invincibility > 0)
-            mvprintw(N+4, 35, "INVULN:%d ", player2Invincibility);
+        lines[2] = playerStatusLine(2, health2, armor2, weapons2, player2SpeedBoost, player2Invincibility);
+    }
+    lines[3].clear();
+    if (profileOverlay) {
+        if (profileLineTick < 0 || profiledTicks - profileLineTick >= PROFILE_REFRESH) {
+            profileLine = profileSummary();
+            profileLineTick = profiledTicks;
+        }
+        lines[3] = profileLine.substr(0, max(0, width));
     }
+}
+
+// The legend and controls under the status lines, one string per row
+vector<string> legendLines() {
+    vector<string> lines;
+    auto print = [&](int row, int col, const string& text) {
+        if ((int)lines.size() <= row) lines.resize(row + 1);
+        string& line = lines[row];
+        if (line.size() < col + text.size()) line.resize(col + text.size(), ' ');
+        line.replace(col, text.size(), text);
+    };
     
-    // Display legend
-    int legendY = N+5;
-    mvprintw(legendY, 1, "Legend:");
+    int legendY = 0;
+    print(legendY, 1, "Legend:");
     int col = 0;
     for (const auto& [symbol, desc] : symbolDescriptions) {
         if (col % 3 == 0 && col > 0) {
             legendY++;
         }
-        mvprintw(legendY + col/3, 10 + (col%3)*20, "%c: %s", symbol, desc.c_str());
+        print(legendY + col/3, 10 + (col%3)*20, string(1, symbol) + ": " + desc);
         col++;
     }
     
     // Controls
-    mvprintw(legendY + col/3 + 1, 1, "Controls: P1: [wasd] + [f] attack | P2: [ijkl] + [;] attack | [p] pause | [q] quit | [m] save");
-    
-    refresh();
+    print(legendY + col/3 + 1, 1, "Controls: P1: [wasd] + [f] attack | P2: [ijkl] + [;] attack | [p] pause | [q] quit | [m] save | [o] profiler");
+    return lines;
 }
 
-int getInput() {
-    return getch();
-}
+// Where frames go and keys come from. printGrid() and getInput() go through
+// the active renderer: ncurses by default, raw ANSI escapes (--render ansi)
+// or nothing at all (--render null), so drawing can be timed or left out
+// without touching the simulation.
+class Renderer {
+public:
+    virtual ~Renderer() = default;
 
-vector<pair<int, int>> dijkstraPath(pair<int, int> src, pair<int, int> target, bool isGhost = false) {
-    vector<vector<int>> dist(N, vector<int>(N, INT_MAX));
-    vector<vector<pair<int, int>>> prev(N, vector<pair<int, int>>(N, {-1, -1}));
-    priority_queue<tuple<int, int, int>, vector<tuple<int, int, int>>, greater<>> pq;
+    // Draws the view, the status lines and the legend. dirtyCells and
+    // fullRedraw tell what changed on the map since the last frame.
+    virtual void drawFrame() = 0;
 
-    dist[src.first][src.second] = 0;
-    pq.push({0, src.first, src.second});
+    // Shows text over the middle of the map until the next frame
+    virtual void drawBanner(const string& text) = 0;
 
-    while (!pq.empty()) {
-        auto [d, x, y] = pq.top(); pq.pop();
-        if (make_pair(x, y) == target) break;
+    // Next key, KEY_RESIZE after the terminal changed size, ERR when there is none
+    virtual int readKey() = 0;
+};
 
-        for (int i = 0; i < 4; ++i) { // Only use cardinal directions for pathfinding
-            int nx = x + dx[i], ny = y + dy[i];
-            if (nx >= 0 && ny >= 0 && nx < N && ny < N) {
-                // Ghost enemies can move through walls
-                if (isGhost || grid[nx][ny] != '#') {
-                    // Calculate movement cost based on terrain
-                    int cost = 1;
-                    if (terrainGrid[nx][ny] == '~') cost = 3; // Water slows down movement
-                    if (terrainGrid[nx][ny] == '%') cost = 2; // Lava is dangerous but can be traversed
-                    
-                    if (dist[nx][ny] > d + cost) {
-                        dist[nx][ny] = d + cost;
-                        prev[nx][ny] = {x, y};
-                        pq.push({dist[nx][ny], nx, ny});
+// Draws nothing, for benchmarks, servers and timing the simulation on its
+// own. Keys are still taken from stdin as plain bytes, so q quits and unread
+// input can't keep waking the game loop.
+class NullRenderer : public Renderer {
+public:
+    void drawFrame() override {}
+    void drawBanner(const string&) override {}
+    int readKey() override {
+        pollfd stdinPoll = {STDIN_FILENO, POLLIN, 0};
+        unsigned char ch;
+        if (poll(&stdinPoll, 1, 0) <= 0 || read(STDIN_FILENO, &ch, 1) != 1) return ERR;
+        return ch;
+    }
+};
+
+unique_ptr<Renderer> renderer = make_unique<NullRenderer>();
+
+// The map, the status lines and the static legend each get their own window
+// so a frame only repaints what changed
+class NcursesRenderer : public Renderer {
+public:
+    // Takes over the terminal, or the given screen from newterm()
+    explicit NcursesRenderer(SCREEN* screen = nullptr) {
+        if (screen) {
+            set_term(screen);
+        } else {
+            initscr();
+        }
+        cbreak();
+        noecho();
+        keypad(stdscr, TRUE);
+        nodelay(stdscr, TRUE);
+        curs_set(0);
+        refresh(); // Flush the initial clear, all drawing goes through windows
+        initColors();
+    }
+
+    ~NcursesRenderer() override {
+        destroyWindows();
+        endwin();
+    }
+
+    void drawFrame() override {
+        int oldRows = viewRows, oldCols = viewCols;
+        int oldTop = viewTop, oldLeft = viewLeft;
+        updateViewport(LINES, COLS);
+        
+        if (LINES != screenLines || COLS != screenCols || viewRows != oldRows || viewCols != oldCols) {
+            createWindows();
+        } else if (viewTop != oldTop || viewLeft != oldLeft) {
+            fullRedraw = true; // Scrolled
+        }
+        
+        if (mapWin) {
+            if (fullRedraw) {
+                for (int x = viewTop; x < viewTop + viewRows; ++x) {
+                    for (int y = viewLeft; y < viewLeft + viewCols; ++y) {
+                        drawCell(x, y);
+                    }
+                }
+            } else {
+                for (int idx : dirtyCells) {
+                    int x = idx / grid.cols, y = idx % grid.cols;
+                    if (x >= viewTop && x < viewTop + viewRows && y >= viewLeft && y < viewLeft + viewCols) {
+                        drawCell(x, y);
                     }
                 }
             }
+            wnoutrefresh(mapWin);
         }
+        
+        drawStatus();
+        doupdate();
     }
 
-    vector<pair<int, int>> path;
-    pair<int, int> cur = target;
-    while (cur != src && prev[cur.first][cur.second] != make_pair(-1, -1)) {
-        path.push_back(cur);
-        cur = prev[cur.first][cur.second];
+    void drawBanner(const string& text) override {
+        if (!mapWin) return;
+        mvwaddstr(mapWin, viewRows/2, viewCols/2-4, text.c_str());
+        wrefresh(mapWin);
     }
-    reverse(path.begin(), path.end());
-    return path;
-}
 
-void checkTerrainEffects(pair<int, int> &player, int &health) {
-    char terrain = terrainGrid[player.first][player.second];
-    
-    if (terrain == '%') { // Lava damages health
-        health = max(0, health - 1);
+    int readKey() override {
+        return getch();
     }
-}
 
-bool attackEnemy(pair<int, int> player, int weaponCount) {
-    if (weaponCount <= 0) return false;
-    
-    // Check all adjacent positions for enemies
-    for (int i = 0; i < 8; ++i) { // Including diagonals
-        int nx = player.first + dx[i];
-        int ny = player.second + dy[i];
+private:
+    // Draws one map cell, which must be inside the viewport
+    void drawCell(int x, int y) {
+        char displayChar = grid.at(x, y);
+        if (displayChar == '.') {
+            displayChar = terrainGrid.at(x, y);
+        }
+        mvwaddch(mapWin, x - viewTop + 1, y - viewLeft + 1, (unsigned char)displayChar | symbolAttr(displayChar));
+    }
+
+    // newwin() fails for windows that stick out of the terminal, so clip them
+    WINDOW* makeWindow(int height, int width, int top, int left) {
+        if (top >= LINES || left >= COLS) return nullptr;
+        return newwin(min(height, LINES - top), min(width, COLS - left), top, left);
+    }
+
+    void destroyWindows() {
+        for (WINDOW** win : {&mapWin, &statusWin, &legendWin}) {
+            if (*win) delwin(*win);
+            *win = nullptr;
+        }
+    }
+
+    // (Re)builds the windows for the current terminal and viewport size
+    void createWindows() {
+        destroyWindows();
+        screenLines = LINES;
+        screenCols = COLS;
         
-        if (nx >= 0 && ny >= 0 && nx < N && ny < N) {
-            char cell = grid[nx][ny];
-            if (cell == 'E' || cell == 'W' || cell == 'H' || cell == 'G' || cell == 'B') {
-                // Find this enemy in our vector
-                for (size_t j = 0; j < enemies.size(); ++j) {
-                    if (get<0>(enemies[j]) == nx && get<1>(enemies[j]) == ny) {
-                        // If it's a boss, it requires multiple hits
-                        if (get<2>(enemies[j]) == BOSS) {
-                            // Deal damage but don't remove yet
-                            // We'll simulate 3 hits to kill a boss
-                            static map<pair<int, int>, int> bossHealth;
-                            if (bossHealth.find({nx, ny}) == bossHealth.end()) {
-                                bossHealth[{nx, ny}] = 3;
-                            }
-                            
-                            bossHealth[{nx, ny}]--;
-                            if (bossHealth[{nx, ny}] <= 0) {
-                                grid[nx][ny] = '.';
-                                enemies.erase(enemies.begin() + j);
-                                score += 50; // Bonus for killing a boss
-                            }
-                        } else {
-                            // Regular enemies die in one hit
-                            grid[nx][ny] = '.';
-                            enemies.erase(enemies.begin() + j);
-                            score += 10; // Bonus for killing an enemy
-                        }
-                        return true;
-                    }
+        erase();
+        wnoutrefresh(stdscr);
+        
+        mapWin = makeWindow(viewRows + 2, viewCols + 2, 0, 0);
+        statusWin = makeWindow(STATUS_HEIGHT, COLS, viewRows + 2, 0);
+        legendWin = makeWindow(HUD_HEIGHT - STATUS_HEIGHT, COLS, viewRows + 2 + STATUS_HEIGHT, 0);
+        
+        if (mapWin) wborder(mapWin, '*', '*', '*', '*', '*', '*', '*', '*');
+        if (legendWin) {
+            vector<string> legend = legendLines();
+            for (size_t row = 0; row < legend.size(); ++row) mvwaddstr(legendWin, row, 0, legend[row].c_str());
+            wnoutrefresh(legendWin);
+        }
+        
+        for (auto& line : statusCache) line.clear();
+        fullRedraw = true;
+    }
+
+    // Rewrites only the status lines whose text changed
+    void drawStatus() {
+        if (!statusWin) return;
+        
+        string lines[STATUS_HEIGHT];
+        statusLines(lines, COLS - 2);
+        for (int i = 0; i < STATUS_HEIGHT; ++i) {
+            if (lines[i] == statusCache[i]) continue;
+            wmove(statusWin, i, 1);
+            wclrtoeol(statusWin);
+            waddstr(statusWin, lines[i].c_str());
+            statusCache[i] = lines[i];
+        }
+        wnoutrefresh(statusWin);
+    }
+
+    WINDOW* mapWin = nullptr;
+    WINDOW* statusWin = nullptr;
+    WINDOW* legendWin = nullptr;
+    int screenLines = 0, screenCols = 0; // Terminal size the windows were built for
+    string statusCache[STATUS_HEIGHT];   // Status lines currently on screen
+};
+
+// Set by SIGWINCH, read by AnsiRenderer::readKey()
+volatile sig_atomic_t terminalResized = 0;
+
+// Draws with plain ANSI escape sequences. The frame is composed in a cell
+// buffer and compared with what the terminal already shows, so a frame sends
+// only the cells that differ, in a single write().
+class AnsiRenderer : public Renderer {
+public:
+    // Draws to outFd. Keys are read from inFd, which is switched to
+    // unbuffered input while the renderer lives; -1 reads no keys.
+    explicit AnsiRenderer(int outFd = STDOUT_FILENO, int inFd = STDIN_FILENO) : out(outFd), in(inFd) {
+        if (in >= 0 && tcgetattr(in, &savedTermios) == 0) {
+            termios raw = savedTermios;
+            raw.c_lflag &= ~(ICANON | ECHO);
+            raw.c_cc[VMIN] = 0; // read() returns at once when no key is waiting
+            raw.c_cc[VTIME] = 0;
+            tcsetattr(in, TCSANOW, &raw);
+            termiosSaved = true;
+        }
+        if (in >= 0) {
+            struct sigaction action = {};
+            action.sa_handler = [](int) { terminalResized = 1; };
+            sigaction(SIGWINCH, &action, &savedWinch); // No SA_RESTART, so poll() wakes up
+        }
+        readSize();
+        frame = "\x1b[?1049h\x1b[?25l"; // Alternate screen, no cursor
+        flush();
+    }
+
+    ~AnsiRenderer() override {
+        frame = "\x1b[0m\x1b[?25h\x1b[?1049l";
+        flush();
+        if (termiosSaved) tcsetattr(in, TCSANOW, &savedTermios);
+        if (in >= 0) sigaction(SIGWINCH, &savedWinch, nullptr);
+    }
+
+    void drawFrame() override {
+        int oldRows = viewRows, oldCols = viewCols;
+        int oldTop = viewTop, oldLeft = viewLeft;
+        updateViewport(lines, cols);
+        
+        if ((int)next.size() != lines * cols || viewRows != oldRows || viewCols != oldCols) {
+            layOut();
+        } else if (viewTop != oldTop || viewLeft != oldLeft) {
+            fullRedraw = true; // Scrolled
+        }
+        
+        if (fullRedraw) {
+            for (int x = viewTop; x < viewTop + viewRows; ++x) {
+                for (int y = viewLeft; y < viewLeft + viewCols; ++y) {
+                    putCell(x, y);
+                }
+            }
+        } else {
+            for (int idx : dirtyCells) {
+                int x = idx / grid.cols, y = idx % grid.cols;
+                if (x >= viewTop && x < viewTop + viewRows && y >= viewLeft && y < viewLeft + viewCols) {
+                    putCell(x, y);
                 }
             }
         }
+        
+        string status[STATUS_HEIGHT];
+        statusLines(status, cols - 2);
+        for (int i = 0; i < STATUS_HEIGHT; ++i) {
+            if (status[i] == statusCache[i]) continue;
+            putText(viewRows + 2 + i, 1, status[i], true);
+            statusCache[i] = status[i];
+        }
+        flush();
     }
-    
-    return false;
-}
 
-void movePlayer(pair<int, int> &player, int &health, int &armor, int &weapons, 
-                int &speedBoost, int &invincibility, int input, char symbol) {
-    int nx = player.first, ny = player.second;
-    bool isMove = false;
-    
-    // Movement
-    if (input == 'w' || input == 'i' || input == KEY_UP) { nx--; isMove = true; }
-    if (input == 's' || input == 'k' || input == KEY_DOWN) { nx++; isMove = true; }
-    if (input == 'a' || input == 'j' || input == KEY_LEFT) { ny--; isMove = true; }
-    if (input == 'd' || input == 'l' || input == KEY_RIGHT) { ny++; isMove = true; }
-    
-    // Attack
-    if (input == 'f' || input == ';' || input == ' ') {
-        bool attackSuccess = attackEnemy(player, weapons);
-        if (attackSuccess) {
-            weapons = max(0, weapons - 1); // Use up weapon charge
+    void drawBanner(const string& text) override {
+        putText(viewRows/2, viewCols/2-4, text, false);
+        flush();
+    }
+
+    int readKey() override {
+        if (terminalResized) {
+            terminalResized = 0;
+            readSize();
+            return KEY_RESIZE;
         }
-        return;
+        if (keys.empty() && in >= 0) {
+            char buf[64];
+            ssize_t n = read(in, buf, sizeof(buf));
+            if (n > 0) keys.assign(buf, n);
+        }
+        if (keys.empty()) return ERR;
+        
+        // Arrow keys arrive as ESC [ A..D
+        int ch = (unsigned char)keys[0];
+        size_t used = 1;
+        if (ch == 0x1b && keys.size() >= 3 && keys[1] == '[') {
+            const char* arrows = "ABCD";
+            const int arrowKeys[] = {KEY_UP, KEY_DOWN, KEY_RIGHT, KEY_LEFT};
+            const char* found = strchr(arrows, keys[2]);
+            ch = found && keys[2] ? arrowKeys[found - arrows] : ERR;
+            used = 3;
+        }
+        keys.erase(0, used);
+        return ch == ERR ? readKey() : ch;
     }
-    
-    if (!isMove) return;
-    
-    if (nx >= 0 && ny >= 0 && nx < N && ny < N && (grid[nx][ny] != '#')) {
-        char target = grid[nx][ny];
+
+private:
+    struct Cell {
+        char ch = ' ';
+        uint8_t style = 0; // Color pair, plus STYLE_BLINK
+        bool operator==(const Cell& other) const { return ch == other.ch && style == other.style; }
+        bool operator!=(const Cell& other) const { return !(*this == other); }
+    };
+    static const uint8_t STYLE_BLINK = 0x80;
+    static const int SHORT_GAP = 4; // Unchanged cells worth rewriting instead of moving past
+
+    void readSize() {
+        winsize size = {};
+        if (ioctl(out, TIOCGWINSZ, &size) == 0 && size.ws_row > 0 && size.ws_col > 0) {
+            lines = size.ws_row;
+            cols = size.ws_col;
+        } else {
+            const char* envLines = getenv("LINES");
+            const char* envCols = getenv("COLUMNS");
+            lines = envLines && atoi(envLines) > 0 ? atoi(envLines) : 24;
+            cols = envCols && atoi(envCols) > 0 ? atoi(envCols) : 80;
+        }
+    }
+
+    // Starts over on a blank screen with the border and legend drawn
+    void layOut() {
+        frame += "\x1b[0m\x1b[2J";
+        shown.assign(lines * cols, Cell());
+        next = shown;
+        rowDirty.assign(lines, 0);
+        penStyle = 0;
+        penRow = penCol = -1;
         
-        // Check for special spaces
-        if (target == '+') health = min(health + 1, 5);
-        else if (target == 'S') speedBoost += 10;
-        else if (target == 'I') invincibility += 10;
-        else if (target == '>') weapons = min(weapons + 3, 10);
-        else if (target == 'A') armor = min(armor + 1, 3);
-        else if (target == 'T') {
-            if (invincibility <= 0) {
-                health = max(0, health - (armor > 0 ? 1 : 2));
-                if (armor > 0) armor--;
+        for (int y = 0; y < viewCols + 2; ++y) {
+            put(0, y, {'*', 0});
+            put(viewRows + 1, y, {'*', 0});
+        }
+        for (int x = 1; x <= viewRows; ++x) {
+            put(x, 0, {'*', 0});
+            put(x, viewCols + 1, {'*', 0});
+        }
+        vector<string> legend = legendLines();
+        for (size_t row = 0; row < legend.size() && (int)row < HUD_HEIGHT - STATUS_HEIGHT; ++row) {
+            putText(viewRows + 2 + STATUS_HEIGHT + row, 0, legend[row], false);
+        }
+        for (auto& line : statusCache) line.clear();
+        fullRedraw = true;
+    }
+
+    void put(int row, int col, Cell cell) {
+        if (row < 0 || row >= lines || col < 0 || col >= cols) return;
+        Cell& target = next[row * cols + col];
+        if (target == cell) return;
+        target = cell;
+        rowDirty[row] = 1;
+    }
+
+    // Writes text from col on, and with clearLine blanks the rest of the row
+    void putText(int row, int col, const string& text, bool clearLine) {
+        for (size_t i = 0; i < text.size(); ++i) put(row, col + i, {text[i], 0});
+        if (clearLine) {
+            for (int y = col + text.size(); y < cols; ++y) put(row, y, Cell());
+        }
+    }
+
+    void putCell(int x, int y) {
+        char symbol = grid.at(x, y);
+        if (symbol == '.') symbol = terrainGrid.at(x, y);
+        chtype attr = symbolAttr(symbol);
+        uint8_t style = PAIR_NUMBER(attr) | (attr & A_BLINK ? STYLE_BLINK : 0);
+        put(x - viewTop + 1, y - viewLeft + 1, {symbol, style});
+    }
+
+    // Appends escapes for every cell of a changed row that differs from the
+    // screen, then sends the frame
+    void flush() {
+        for (int row = 0; row < (int)rowDirty.size(); ++row) {
+            if (!rowDirty[row]) continue;
+            rowDirty[row] = 0;
+            for (int col = 0; col < cols; ++col) {
+                int i = row * cols + col;
+                if (next[i] == shown[i]) continue;
+                if (row == penRow && col > penCol && col - penCol <= SHORT_GAP) {
+                    // Rewriting a few unchanged cells is shorter than moving the cursor
+                    int gap = row * cols + penCol;
+                    while (gap < i && shown[gap].style == penStyle) frame += shown[gap++].ch;
+                    penCol = gap - row * cols;
+                }
+                if (row != penRow || col != penCol) {
+                    frame += "\x1b[" + to_string(row + 1) + ";" + to_string(col + 1) + "H";
+                }
+                if (next[i].style != penStyle) {
+                    frame += styleEscape(next[i].style);
+                    penStyle = next[i].style;
+                }
+                frame += next[i].ch;
+                shown[i] = next[i];
+                penRow = row;
+                penCol = col + 1;
+            }
+        }
+        
+        size_t sent = 0;
+        while (sent < frame.size()) {
+            ssize_t n = write(out, frame.data() + sent, frame.size() - sent);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            sent += n;
+        }
+        frame.clear();
+    }
+
+    static string styleEscape(uint8_t style) {
+        int pair = style & ~STYLE_BLINK;
+        if (pair == 0) return "\x1b[0m";
+        string escape = "\x1b[0;" + to_string(30 + COLOR_PAIR_COLORS[pair][0]) + ";" +
+                        to_string(40 + COLOR_PAIR_COLORS[pair][1]);
+        if (style & STYLE_BLINK) escape += ";5";
+        return escape + "m";
+    }
+
+    int out, in;
+    termios savedTermios = {};
+    bool termiosSaved = false;
+    struct sigaction savedWinch = {};
+    int lines = 0, cols = 0;
+    vector<Cell> shown, next;          // What the terminal shows, what the frame wants
+    vector<char> rowDirty;             // Rows where next may differ from shown
+    uint8_t penStyle = 0;
+    int penRow = -1, penCol = -1;      // Where the terminal's cursor is
+    string frame;                      // Bytes for the next write()
+    string keys;                       // Read but not yet returned
+    string statusCache[STATUS_HEIGHT]; // Status lines currently in next
+};
+
+// Switches drawing and key input to the named renderer: "ncurses", "ansi"
+// or anything else for none
+void openRenderer(const string& name) {
+    renderer = make_unique<NullRenderer>(); // Hand the terminal back before taking it again
+    if (name == "ncurses") {
+        renderer = make_unique<NcursesRenderer>();
+    } else if (name == "ansi") {
+        renderer = make_unique<AnsiRenderer>();
+    }
+}
+
+// Restores the terminal
+void closeRenderer() {
+    renderer = make_unique<NullRenderer>();
+}
+
+// Draws a frame with the active renderer, after which nothing on the map
+// counts as changed
+void printGrid() {
+    PhaseTimer timer(PHASE_RENDER);
+    renderer->drawFrame();
+    clearDirtyCells();
+}
+
+int getInput() {
+    return renderer->readKey();
+}
+
+// Cost of stepping onto a cell, based on its terrain
+int terrainCost(const TileGrid& terrain, int x, int y) {
+    if (terrain.at(x, y) == '~') return 3; // Water slows down movement
+    if (terrain.at(x, y) == '%') return 2; // Lava is dangerous but can be traversed
+    return 1;
+}
+
+int terrainCost(int x, int y) {
+    return terrainCost(terrainGrid, x, y);
+}
+
+// Scratch space for point-to-point searches, kept between calls so a search
+// does not allocate once the buffers have grown to the map size. A cell's g and
+// parent are only meaningful when its stamp matches the current generation,
+// which saves clearing them for every search.
+struct PathScratch {
+    vector<int> g;
+    vector<int> parent;
+    vector<uint32_t> stamp;
+    uint32_t generation = 0;
+    vector<int> buckets[8]; // Open cells by f, modulo 8
+};
+thread_local PathScratch pathScratch;
+
+// A* from src to target with a Manhattan heuristic. Steps cost 1 to 3 and the
+// heuristic changes by 1 per step, so f grows by at most 4 per expansion and
+// the open set always fits in a ring of 8 buckets (a Dial queue). Fills path
+// with the cells after src up to and including target and returns true, or
+// clears it and returns false if target can't be reached. avoidEnemies treats
+// occupied cells other than target as blocked, and the search gives up after
+// expanding budget cells.
+bool findPath(pair<int, int> src, pair<int, int> target, bool isGhost, vector<pair<int, int>>& path,
+              bool avoidEnemies = false, int budget = INT_MAX) {
+    PhaseTimer timer(PHASE_PATHS);
+    path.clear();
+    if (!grid.inBounds(src.first, src.second) || !grid.inBounds(target.first, target.second)) return false;
+    if (src == target) return false;
+
+    PathScratch& s = pathScratch;
+    size_t cells = grid.cells.size();
+    if (s.stamp.size() != cells) {
+        s.g.assign(cells, 0);
+        s.parent.assign(cells, -1);
+        s.stamp.assign(cells, 0);
+        s.generation = 0;
+    }
+    if (++s.generation == 0) { // Wrapped, old stamps could look current
+        fill(s.stamp.begin(), s.stamp.end(), 0);
+        s.generation = 1;
+    }
+    for (auto& bucket : s.buckets) bucket.clear();
+
+    int tx = target.first, ty = target.second;
+    auto heuristic = [&](int x, int y) { return abs(x - tx) + abs(y - ty); };
+
+    int start = grid.index(src.first, src.second);
+    int goal = grid.index(tx, ty);
+    s.g[start] = 0;
+    s.parent[start] = -1;
+    s.stamp[start] = s.generation;
+    s.buckets[heuristic(src.first, src.second) & 7].push_back(start);
+
+    int f = heuristic(src.first, src.second);
+    int open = 1;
+    bool found = false;
+    while (open > 0) {
+        vector<int>& bucket = s.buckets[f & 7];
+        if (bucket.empty()) {
+            ++f;
+            continue;
+        }
+        int cell = bucket.back();
+        bucket.pop_back();
+        --open;
+
+        int x = cell / grid.cols, y = cell % grid.cols;
+        if (s.g[cell] + heuristic(x, y) != f) continue; // Stale, improved since it was queued
+        if (cell == goal) {
+            found = true;
+            break;
+        }
+        if (--budget < 0) break;
+
+        for (int i = 0; i < 4; ++i) { // Only use cardinal directions for pathfinding
+            int nx = x + dx[i], ny = y + dy[i];
+            if (!valid(nx, ny, isGhost)) continue;
+
+            int next = grid.index(nx, ny);
+            if (avoidEnemies && next != goal && enemyAt[next] >= 0) continue;
+            int g = s.g[cell] + terrainCost(nx, ny);
+            if (s.stamp[next] == s.generation && s.g[next] <= g) continue;
+
+            s.g[next] = g;
+            s.parent[next] = cell;
+            s.stamp[next] = s.generation;
+            s.buckets[(g + heuristic(nx, ny)) & 7].push_back(next);
+            ++open;
+        }
+    }
+    if (!found) return false;
+
+    for (int cell = goal; cell != start; cell = s.parent[cell]) {
+        path.push_back({cell / grid.cols, cell % grid.cols});
+    }
+    reverse(path.begin(), path.end());
+    return true;
+}
+
+// Cheapest path from src to target, empty if there is none
+vector<pair<int, int>> dijkstraPath(pair<int, int> src, pair<int, int> target, bool isGhost = false) {
+    vector<pair<int, int>> path;
+    findPath(src, target, isGhost, path);
+    return path;
+}
+
+// Distance fields toward the players, rebuilt once per enemy tick and shared by
+// every enemy. chaseField respects walls, ghostField ignores them. On big maps
+// they only cover a window around the players, see updateDistanceFields().
+thread_local vector<int> chaseField;
+thread_local vector<int> ghostField;
+thread_local int fieldTop = 0, fieldLeft = 0, fieldBottom = 0, fieldRight = 0; // Inclusive window
+thread_local bool useHierarchy = false; // Enemies outside the window route through clusters
+
+// Window a field was last built over, in the columns of the grid it was built
+// for. Every cell outside it holds INT_MAX.
+struct FieldWindow {
+    int top = 0, left = 0, bottom = -1, right = -1, cols = 0;
+};
+thread_local FieldWindow chaseWindow, ghostWindow;
+
+// Maps with fewer cells than this keep full-map fields
+const int HIERARCHY_MIN_CELLS = 128 * 128;
+const int LOCAL_FIELD_RADIUS = 32; // Must exceed CLUSTER_SIZE
+
+bool inFieldWindow(int x, int y) {
+    return x >= fieldTop && x <= fieldBottom && y >= fieldLeft && y <= fieldRight;
+}
+
+// Reverse Dijkstra from every target cell. A cell's value is the cost for an
+// enemy standing there to reach the nearest target, paying the terrain cost of
+// each cell it steps onto. Cells outside the field window stay at INT_MAX.
+void buildDistanceField(vector<int>& field, FieldWindow& built, const vector<pair<int, int>>& targets, bool isGhost) {
+    if (field.size() != grid.cells.size()) {
+        field.assign(grid.cells.size(), INT_MAX);
+    } else {
+        // Only the previous window holds distances, so only it needs clearing
+        for (int x = built.top; x <= built.bottom; ++x) {
+            auto row = field.begin() + (size_t)x * built.cols;
+            fill(row + built.left, row + built.right + 1, INT_MAX);
+        }
+    }
+    built = {fieldTop, fieldLeft, fieldBottom, fieldRight, grid.cols};
+    priority_queue<pair<int, int>, vector<pair<int, int>>, greater<>> pq;
+
+    for (const auto& t : targets) {
+        field[grid.index(t.first, t.second)] = 0;
+        pq.push({0, grid.index(t.first, t.second)});
+    }
+
+    while (!pq.empty()) {
+        auto [d, cell] = pq.top(); pq.pop();
+        if (d > field[cell]) continue;
+
+        int x = cell / grid.cols, y = cell % grid.cols;
+        int stepCost = d + terrainCost(x, y); // Entering (x, y) from a neighbor
+
+        for (int i = 0; i < 4; ++i) {
+            int nx = x + dx[i], ny = y + dy[i];
+            if (!valid(nx, ny, isGhost) || !inFieldWindow(nx, ny)) continue;
+
+            int next = grid.index(nx, ny);
+            if (field[next] > stepCost) {
+                field[next] = stepCost;
+                pq.push({stepCost, next});
+            }
+        }
+    }
+}
+
+// Hierarchical pathfinding (HPA*) for enemies far from the players. The grid is
+// split into CLUSTER_SIZE squares. Entrances are cells on a cluster's edge with
+// an open cell across the border, and each cluster caches the cheapest inner
+// path between every pair of its entrances. Every enemy tick a Dijkstra over
+// the entrances alone gives each one its cost to the nearest player. A cluster
+// with far enemies in it then gets a small field seeded from its entrances,
+// so each enemy's step is refined from its own cluster only.
+struct Cluster {
+    int top = 0, left = 0, rows = 0, cols = 0;
+    vector<int> nodes; // Entrance cells
+    vector<int> costs; // costs[i * nodes.size() + j], cheapest inner path from entrance i to j
+    vector<int> dist;  // Cost from each entrance to the nearest player, refreshed every enemy tick
+    vector<int> field; // Cost from each cell to the nearest player, built on demand
+    uint32_t fieldTick = 0; // entranceTick the field was built for
+};
+
+struct ClusterHierarchy {
+    int clusterRows = 0, clusterCols = 0;
+    vector<Cluster> clusters;
+    vector<int> nodeSlot; // Cell -> index in its cluster's nodes, -1 if not an entrance
+};
+thread_local ClusterHierarchy hierarchy;
+thread_local uint32_t entranceTick = 0; // Bumped whenever entrance costs change
+
+int clusterOf(int x, int y) {
+    return (x / CLUSTER_SIZE) * hierarchy.clusterCols + y / CLUSTER_SIZE;
+}
+
+int clusterLocal(const Cluster& c, int cell) {
+    return (cell / grid.cols - c.top) * CLUSTER_SIZE + (cell % grid.cols - c.left);
+}
+
+// Scratch for searches inside one cluster, indexed by clusterLocal()
+struct ClusterSearch {
+    int cost[CLUSTER_SIZE * CLUSTER_SIZE]; // Terrain cost of entering each cell, 0 for walls
+    int dist[CLUSTER_SIZE * CLUSTER_SIZE];
+    int parent[CLUSTER_SIZE * CLUSTER_SIZE];
+    vector<pair<int, int>> seeds; // Local cell, starting cost
+    vector<int> buckets[4];       // Dial queue, steps cost at most 3
+};
+thread_local ClusterSearch clusterSearch;
+
+void loadClusterCosts(const Cluster& c) {
+    for (int lx = 0; lx < c.rows; ++lx) {
+        for (int ly = 0; ly < c.cols; ++ly) {
+            int x = c.top + lx, y = c.left + ly;
+            clusterSearch.cost[lx * CLUSTER_SIZE + ly] = mapBits.walls.test(x, y) ? 0 : terrainCost(x, y);
+        }
+    }
+}
+
+// Dijkstra that never leaves cluster c, over the costs of the last
+// loadClusterCosts(c), from every seed at once. Forward, dist is the cost from
+// the seeds to each cell and parent leads back to one. In reverse, dist is the
+// cost for each cell to reach a seed. Both pay the cost of every cell entered.
+void searchCluster(const Cluster& c, bool reverse) {
+    ClusterSearch& s = clusterSearch;
+    fill(begin(s.dist), end(s.dist), INT_MAX);
+    for (auto& bucket : s.buckets) bucket.clear();
+    sort(s.seeds.begin(), s.seeds.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+
+    size_t nextSeed = 0;
+    int open = 0;
+    for (int d = s.seeds.empty() ? 0 : s.seeds[0].second; open > 0 || nextSeed < s.seeds.size(); ++d) {
+        if (open == 0) d = max(d, s.seeds[nextSeed].second); // Skip the gap to the next seed
+        for (; nextSeed < s.seeds.size() && s.seeds[nextSeed].second == d; ++nextSeed) {
+            int cell = s.seeds[nextSeed].first;
+            if (d < s.dist[cell]) {
+                s.dist[cell] = d;
+                s.parent[cell] = -1;
+                s.buckets[d & 3].push_back(cell);
+                ++open;
+            }
+        }
+
+        vector<int>& bucket = s.buckets[d & 3];
+        while (!bucket.empty()) {
+            int cur = bucket.back();
+            bucket.pop_back();
+            --open;
+            if (s.dist[cur] != d) continue; // Stale
+
+            int lx = cur / CLUSTER_SIZE, ly = cur % CLUSTER_SIZE;
+            for (int i = 0; i < 4; ++i) {
+                int nlx = lx + dx[i], nly = ly + dy[i];
+                if (nlx < 0 || nlx >= c.rows || nly < 0 || nly >= c.cols) continue;
+
+                int next = nlx * CLUSTER_SIZE + nly;
+                if (s.cost[next] == 0) continue; // Wall
+                int nd = d + (reverse ? s.cost[cur] : s.cost[next]);
+                if (nd < s.dist[next]) {
+                    s.dist[next] = nd;
+                    s.parent[next] = cur;
+                    s.buckets[nd & 3].push_back(next);
+                    ++open;
+                }
+            }
+        }
+    }
+}
+
+void searchCluster(const Cluster& c, int start, bool reverse) {
+    clusterSearch.seeds.assign(1, {clusterLocal(c, start), 0});
+    searchCluster(c, reverse);
+}
+
+// Entrances on one side of cluster c (a dx/dy direction). Each run of open
+// cells facing open cells across the border gets an entrance in its middle, or
+// one at each end if it is long. Both clusters on a border see the same runs,
+// so their entrances line up.
+void addBorderEntrances(Cluster& c, int side) {
+    bool horizontal = dx[side] != 0; // Border runs along a row
+    int length = horizontal ? c.cols : c.rows;
+    int innerX = side == 1 ? c.top + c.rows - 1 : c.top;
+    int innerY = side == 3 ? c.left + c.cols - 1 : c.left;
+    if (!grid.inBounds(innerX + dx[side], innerY + dy[side])) return; // Map edge
+
+    auto cellAt = [&](int k) { return horizontal ? make_pair(innerX, c.left + k) : make_pair(c.top + k, innerY); };
+    auto open = [&](int k) {
+        auto [x, y] = cellAt(k);
+        return !mapBits.walls.test(x, y) && !mapBits.walls.test(x + dx[side], y + dy[side]);
+    };
+
+    for (int k = 0; k < length; ++k) {
+        if (!open(k)) continue;
+        int runStart = k;
+        while (k + 1 < length && open(k + 1)) ++k;
+
+        if (k - runStart + 1 < 6) {
+            auto [x, y] = cellAt((runStart + k) / 2);
+            c.nodes.push_back(grid.index(x, y));
+        } else {
+            auto [x1, y1] = cellAt(runStart);
+            auto [x2, y2] = cellAt(k);
+            c.nodes.push_back(grid.index(x1, y1));
+            c.nodes.push_back(grid.index(x2, y2));
+        }
+    }
+}
+
+void rebuildCluster(int index) {
+    Cluster& c = hierarchy.clusters[index];
+    for (int cell : c.nodes) hierarchy.nodeSlot[cell] = -1;
+    c.nodes.clear();
+    c.fieldTick = 0;
+
+    for (int side = 0; side < 4; ++side) addBorderEntrances(c, side);
+    sort(c.nodes.begin(), c.nodes.end());
+    c.nodes.erase(unique(c.nodes.begin(), c.nodes.end()), c.nodes.end()); // Corners face two borders
+
+    size_t n = c.nodes.size();
+    for (size_t i = 0; i < n; ++i) hierarchy.nodeSlot[c.nodes[i]] = i;
+
+    loadClusterCosts(c);
+    c.costs.assign(n * n, INT_MAX);
+    for (size_t i = 0; i < n; ++i) {
+        searchCluster(c, c.nodes[i], false);
+        for (size_t j = 0; j < n; ++j) {
+            c.costs[i * n + j] = clusterSearch.dist[clusterLocal(c, c.nodes[j])];
+        }
+    }
+}
+
+void buildHierarchy() {
+    hierarchy.clusterRows = (grid.rows + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    hierarchy.clusterCols = (grid.cols + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    hierarchy.clusters.assign(hierarchy.clusterRows * hierarchy.clusterCols, Cluster());
+    hierarchy.nodeSlot.assign(grid.cells.size(), -1);
+
+    for (int cx = 0; cx < hierarchy.clusterRows; ++cx) {
+        for (int cy = 0; cy < hierarchy.clusterCols; ++cy) {
+            Cluster& c = hierarchy.clusters[cx * hierarchy.clusterCols + cy];
+            c.top = cx * CLUSTER_SIZE;
+            c.left = cy * CLUSTER_SIZE;
+            c.rows = min(CLUSTER_SIZE, grid.rows - c.top);
+            c.cols = min(CLUSTER_SIZE, grid.cols - c.left);
+        }
+    }
+    for (size_t i = 0; i < hierarchy.clusters.size(); ++i) rebuildCluster(i);
+
+    clusterDirty.assign(hierarchy.clusters.size(), 0);
+    dirtyClusterList.clear();
+    hierarchyStale = false;
+}
+
+// Brings the hierarchy up to date with the walls, rebuilding only the clusters
+// markWallChanged() flagged unless the whole level changed
+void refreshHierarchy() {
+    if (hierarchyStale || hierarchy.nodeSlot.size() != grid.cells.size()) {
+        buildHierarchy();
+        return;
+    }
+    for (int cluster : dirtyClusterList) {
+        rebuildCluster(cluster);
+        clusterDirty[cluster] = 0;
+    }
+    dirtyClusterList.clear();
+}
+
+// Reverse Dijkstra over the entrances: each target seeds the entrances of its
+// own cluster, then costs spread along cached inner paths and border crossings.
+// No edge costs more than a path through every cell of a cluster, so a Dial
+// queue of ENTRANCE_BUCKETS buckets holds every open entrance.
+const int ENTRANCE_BUCKETS = 1024;
+static_assert(ENTRANCE_BUCKETS > 3 * CLUSTER_SIZE * CLUSTER_SIZE, "Dial queue too small for inner paths");
+thread_local vector<vector<int>> entranceBuckets;
+
+void updateEntranceDistances(const vector<pair<int, int>>& targets) {
+    for (auto& c : hierarchy.clusters) c.dist.assign(c.nodes.size(), INT_MAX);
+    entranceBuckets.resize(ENTRANCE_BUCKETS);
+    for (auto& bucket : entranceBuckets) bucket.clear();
+    ++entranceTick;
+
+    int open = 0;
+    auto relax = [&](int cell, int d) {
+        Cluster& c = hierarchy.clusters[clusterOf(cell / grid.cols, cell % grid.cols)];
+        int& current = c.dist[hierarchy.nodeSlot[cell]];
+        if (d < current) {
+            current = d;
+            entranceBuckets[d % ENTRANCE_BUCKETS].push_back(cell);
+            ++open;
+        }
+    };
+
+    int start = INT_MAX;
+    for (const auto& t : targets) {
+        const Cluster& c = hierarchy.clusters[clusterOf(t.first, t.second)];
+        loadClusterCosts(c);
+        searchCluster(c, grid.index(t.first, t.second), true);
+        for (int cell : c.nodes) {
+            int d = clusterSearch.dist[clusterLocal(c, cell)];
+            if (d == INT_MAX) continue;
+            relax(cell, d);
+            start = min(start, d);
+        }
+    }
+
+    for (int d = start; open > 0; ++d) {
+        vector<int>& bucket = entranceBuckets[d % ENTRANCE_BUCKETS];
+        while (!bucket.empty()) {
+            int cell = bucket.back();
+            bucket.pop_back();
+            --open;
+
+            int x = cell / grid.cols, y = cell % grid.cols;
+            int ci = clusterOf(x, y);
+            const Cluster& c = hierarchy.clusters[ci];
+            int slot = hierarchy.nodeSlot[cell];
+            if (c.dist[slot] != d) continue; // Stale
+
+            // Other entrances of this cluster reach this one along inner paths
+            size_t n = c.nodes.size();
+            for (size_t i = 0; i < n; ++i) {
+                int cost = c.costs[i * n + slot];
+                if (cost != INT_MAX) relax(c.nodes[i], d + cost);
+            }
+
+            // Entrances across the border step straight onto this one
+            for (int i = 0; i < 4; ++i) {
+                int nx = x + dx[i], ny = y + dy[i];
+                if (!grid.inBounds(nx, ny) || clusterOf(nx, ny) == ci) continue;
+                int next = grid.index(nx, ny);
+                if (hierarchy.nodeSlot[next] >= 0) relax(next, d + terrainCost(x, y));
+            }
+        }
+    }
+}
+
+// The cluster's field for this tick, seeded with its entrance costs
+const vector<int>& clusterField(Cluster& c) {
+    if (c.fieldTick == entranceTick) return c.field;
+
+    clusterSearch.seeds.clear();
+    for (size_t j = 0; j < c.nodes.size(); ++j) {
+        if (c.dist[j] != INT_MAX) clusterSearch.seeds.push_back({clusterLocal(c, c.nodes[j]), c.dist[j]});
+    }
+    loadClusterCosts(c);
+    searchCluster(c, true);
+    c.field.assign(begin(clusterSearch.dist), end(clusterSearch.dist));
+    c.fieldTick = entranceTick;
+    return c.field;
+}
+
+// Next step for a walking enemy outside the field window: downhill on its
+// cluster's field, or across the border when it stands on the entrance that
+// leads there
+pair<int, int> hierarchyStep(int x, int y) {
+    int ci = clusterOf(x, y);
+    Cluster& c = hierarchy.clusters[ci];
+    const vector<int>& field = clusterField(c);
+
+    pair<int, int> best = {x, y};
+    long long bestDist = LLONG_MAX;
+    for (int i = 0; i < 4; ++i) {
+        int nx = x + dx[i], ny = y + dy[i];
+        if (!valid(nx, ny)) continue;
+
+        long long d = INT_MAX;
+        if (clusterOf(nx, ny) == ci) {
+            d = field[clusterLocal(c, grid.index(nx, ny))];
+        } else if (hierarchy.nodeSlot[grid.index(x, y)] >= 0 && hierarchy.nodeSlot[grid.index(nx, ny)] >= 0) {
+            d = hierarchy.clusters[clusterOf(nx, ny)].dist[hierarchy.nodeSlot[grid.index(nx, ny)]];
+        }
+        if (d == INT_MAX) continue;
+
+        d += terrainCost(nx, ny);
+        if (d < bestDist) {
+            bestDist = d;
+            best = {nx, ny};
+        }
+    }
+    return best;
+}
+
+// Closes the distance to the nearest player through the cheapest terrain. Far
+// ghosts ignore walls so this is all they need.
+pair<int, int> greedyStep(int x, int y, bool isGhost) {
+    pair<int, int> target = player1;
+    if (multiplayer && abs(player2.first - x) + abs(player2.second - y) < abs(player1.first - x) + abs(player1.second - y)) {
+        target = player2;
+    }
+
+    pair<int, int> best = {x, y};
+    int bestCost = INT_MAX;
+    int distance = abs(target.first - x) + abs(target.second - y);
+    for (int i = 0; i < 4; ++i) {
+        int nx = x + dx[i], ny = y + dy[i];
+        if (!valid(nx, ny, isGhost) || abs(target.first - nx) + abs(target.second - ny) >= distance) continue;
+        if (terrainCost(nx, ny) < bestCost) {
+            bestCost = terrainCost(nx, ny);
+            best = {nx, ny};
+        }
+    }
+    return best;
+}
+
+// Incremental enemy AI (--ai incremental). Instead of sharing a field rebuilt
+// every tick, each enemy keeps the path it planned and repairs it, in the
+// spirit of D* Lite:
+// - steps it took come off the front, and a detour (a wanderer's random step)
+//   is joined back to the path with a small local search
+// - player moves are spliced onto the end with a small local search, or cut
+//   the path short if the player walked back onto it
+// - an enemy blocking the next step is routed around over the next few cells
+// A full A* plan only happens when a repair fails, the walls changed, or the
+// splices have added enough steps that a fresh plan is likely shorter.
+struct EnemyRoute {
+    vector<pair<int, int>> path;       // Cells to walk, path[next] first
+    size_t next = 0;
+    pair<int, int> at = {-1, -1};      // Where the enemy stood when path[next] was handed out
+    int player = 1;                    // Player the route leads to
+    pair<int, int> target = {-1, -1};  // Their position when the route was last repaired
+    unsigned wallVersion = 0;
+    int splicedSteps = 0;              // Steps added by repairs since the last full plan
+};
+thread_local vector<EnemyRoute> enemyRoutes; // By enemy id
+thread_local vector<pair<int, int>> spliceScratch;
+thread_local int replansLeft = 0;            // Full plans still allowed this tick
+
+const int SPLICE_RADIUS = 6;      // Further player moves force a full plan
+const int SPLICE_BUDGET = 256;    // Cells a local repair search may expand
+const int MAX_SPLICED_STEPS = 24;
+const int DETOUR_LOOKAHEAD = 6;
+const int REPLAN_BUDGET = 64;     // Full plans per enemy tick, the rest walk greedily until their turn
+
+pair<int, int> playerPosition(int id) {
+    return id == 2 ? player2 : player1;
+}
+
+int manhattan(pair<int, int> a, pair<int, int> b) {
+    return abs(a.first - b.first) + abs(a.second - b.second);
+}
+
+// Fresh A* plan to the nearer player, or the other one if that fails. An empty
+// path means neither can be reached until the walls change.
+void planRoute(EnemyRoute& r, int x, int y, bool isGhost) {
+    int first = multiplayer && manhattan({x, y}, player2) < manhattan({x, y}, player1) ? 2 : 1;
+    r.player = first;
+    if (!findPath({x, y}, playerPosition(first), isGhost, r.path) && multiplayer) {
+        r.player = 3 - first;
+        findPath({x, y}, playerPosition(r.player), isGhost, r.path);
+    }
+    r.target = playerPosition(r.player);
+    r.next = 0;
+    r.at = {x, y};
+    r.wallVersion = wallVersion;
+    r.splicedSteps = 0;
+}
+
+// The enemy stepped off its route to (x, y): join it back at path[next]
+bool rejoinRoute(EnemyRoute& r, int x, int y, bool isGhost) {
+    if (manhattan({x, y}, r.path[r.next]) > 2) return false;
+    if (!findPath({x, y}, r.path[r.next], isGhost, spliceScratch, false, SPLICE_BUDGET)) return false;
+
+    r.path.erase(r.path.begin(), r.path.begin() + r.next + 1);
+    r.path.insert(r.path.begin(), spliceScratch.begin(), spliceScratch.end());
+    r.next = 0;
+    r.at = {x, y};
+    r.splicedSteps += spliceScratch.size();
+    return r.splicedSteps <= MAX_SPLICED_STEPS;
+}
+
+// Moves the end of the route to wherever the player went
+bool followTarget(EnemyRoute& r, bool isGhost) {
+    pair<int, int> p = playerPosition(r.player);
+    if (p == r.target) return true;
+
+    // Walked back onto the route, only the last few cells are worth checking
+    size_t from = max(r.next, r.path.size() - min(r.path.size(), size_t(2 * SPLICE_RADIUS)));
+    for (size_t k = from; k < r.path.size(); ++k) {
+        if (r.path[k] == p) {
+            r.path.resize(k + 1);
+            r.target = p;
+            return true;
+        }
+    }
+
+    if (manhattan(p, r.target) > SPLICE_RADIUS) return false;
+    if (!findPath(r.target, p, isGhost, spliceScratch, false, SPLICE_BUDGET)) return false;
+    r.path.insert(r.path.end(), spliceScratch.begin(), spliceScratch.end());
+    r.target = p;
+    r.splicedSteps += spliceScratch.size();
+    return r.splicedSteps <= MAX_SPLICED_STEPS;
+}
+
+// Another enemy stands on the next step: walk around it to one of the next few
+// path cells if that costs only a few extra steps, otherwise wait behind it
+void detourAroundEnemy(EnemyRoute& r, int x, int y, bool isGhost) {
+    size_t last = min(r.path.size() - 1, r.next + DETOUR_LOOKAHEAD);
+    for (size_t k = r.next + 1; k <= last; ++k) {
+        auto [px, py] = r.path[k];
+        if (enemyIdAt(px, py) >= 0) continue;
+        if (!findPath({x, y}, r.path[k], isGhost, spliceScratch, true, SPLICE_BUDGET)) return;
+        if (spliceScratch.size() > k - r.next + 3) return;
+
+        r.path.erase(r.path.begin() + r.next, r.path.begin() + k + 1);
+        r.path.insert(r.path.begin() + r.next, spliceScratch.begin(), spliceScratch.end());
+        r.splicedSteps += spliceScratch.size() - (k - r.next + 1);
+        return;
+    }
+}
+
+// Next cell for enemy id at (x, y) on its repaired route
+pair<int, int> incrementalStep(int id, int x, int y, bool isGhost) {
+    if (id >= (int)enemyRoutes.size()) enemyRoutes.resize(id + 1);
+    EnemyRoute& r = enemyRoutes[id];
+    pair<int, int> here = {x, y};
+
+    bool ok = r.wallVersion == wallVersion && r.at != make_pair(-1, -1);
+    if (ok && r.path.empty()) {
+        if (here == r.at) return here; // Still cut off from both players
+        ok = false;
+    }
+    if (ok && r.next < r.path.size() && here == r.path[r.next]) {
+        r.at = here; // Took the step handed out last time
+        ++r.next;
+    } else if (ok && here != r.at) {
+        ok = r.next < r.path.size() && rejoinRoute(r, x, y, isGhost);
+    }
+    if (ok && multiplayer && manhattan(here, playerPosition(3 - r.player)) + SPLICE_RADIUS < manhattan(here, r.target)) {
+        ok = false; // The other player is now much closer
+    }
+    if (ok) ok = followTarget(r, isGhost);
+
+    if (!ok || r.next >= r.path.size()) {
+        if (replansLeft <= 0) {
+            r.at = {-1, -1}; // Plan on a later tick
+            return greedyStep(x, y, isGhost);
+        }
+        --replansLeft;
+        planRoute(r, x, y, isGhost);
+        if (r.path.empty()) return here;
+    }
+
+    // Drop walked cells now and then so the path doesn't keep growing
+    if (r.next > 64 && r.next * 2 > r.path.size()) {
+        r.path.erase(r.path.begin(), r.path.begin() + r.next);
+        r.next = 0;
+    }
+
+    auto [nx, ny] = r.path[r.next];
+    if (enemyIdAt(nx, ny) >= 0) detourAroundEnemy(r, x, y, isGhost);
+    return r.path[r.next];
+}
+
+void updateDistanceFields() {
+    PhaseTimer timer(PHASE_FIELDS);
+    if (incrementalAI) { // Enemies keep their own routes
+        replansLeft = REPLAN_BUDGET;
+        return;
+    }
+
+    vector<pair<int, int>> targets = {player1};
+    if (multiplayer) targets.push_back(player2);
+
+    useHierarchy = (long long)grid.rows * grid.cols >= HIERARCHY_MIN_CELLS;
+    if (useHierarchy) {
+        fieldTop = fieldBottom = player1.first;
+        fieldLeft = fieldRight = player1.second;
+        for (const auto& t : targets) {
+            fieldTop = min(fieldTop, t.first);
+            fieldBottom = max(fieldBottom, t.first);
+            fieldLeft = min(fieldLeft, t.second);
+            fieldRight = max(fieldRight, t.second);
+        }
+        fieldTop = max(0, fieldTop - LOCAL_FIELD_RADIUS);
+        fieldLeft = max(0, fieldLeft - LOCAL_FIELD_RADIUS);
+        fieldBottom = min(grid.rows - 1, fieldBottom + LOCAL_FIELD_RADIUS);
+        fieldRight = min(grid.cols - 1, fieldRight + LOCAL_FIELD_RADIUS);
+
+        refreshHierarchy();
+        updateEntranceDistances(targets);
+    } else {
+        fieldTop = fieldLeft = 0;
+        fieldBottom = grid.rows - 1;
+        fieldRight = grid.cols - 1;
+    }
+
+    buildDistanceField(chaseField, chaseWindow, targets, false);
+
+    // Enemies that go through walls follow a field of their own
+    int throughWalls = 0;
+    for (int type = 0; type < ENEMY_TYPES; ++type) {
+        if (ENEMY_THROUGH_WALLS[type]) throughWalls += enemies.typeCount[type];
+    }
+    if (throughWalls > 0) buildDistanceField(ghostField, ghostWindow, targets, true);
+}
+
+// Downhill neighbor on a distance field, or the cell itself if no neighbor
+// gets closer to a target. Only reads what it is given, so worker threads can
+// call it with the game thread's walls and terrain.
+pair<int, int> fieldStep(const BitPlane& walls, const TileGrid& terrain, const vector<int>& field,
+                         int x, int y, bool isGhost) {
+    pair<int, int> best = {x, y};
+    long long bestDist = LLONG_MAX;
+
+    for (int i = 0; i < 4; ++i) {
+        int nx = x + dx[i], ny = y + dy[i];
+        if (!valid(walls, nx, ny, isGhost)) continue;
+        int cell = terrain.index(nx, ny);
+        if (field[cell] == INT_MAX) continue;
+
+        long long d = (long long)field[cell] + terrainCost(terrain, nx, ny);
+        if (d < bestDist) {
+            bestDist = d;
+            best = {nx, ny};
+        }
+    }
+    return best;
+}
+
+pair<int, int> fieldStep(const vector<int>& field, int x, int y, bool isGhost) {
+    return fieldStep(mapBits.walls, terrainGrid, field, x, y, isGhost);
+}
+
+// True when chaseStep() takes the shared field's step for an enemy at (x, y).
+// That step only reads the field, the other kinds update caches as they go.
+bool chasesOnField(int x, int y, bool isGhost) {
+    if (incrementalAI) return false;
+    const vector<int>& field = isGhost ? ghostField : chaseField;
+    return !useHierarchy || (inFieldWindow(x, y) && field[grid.index(x, y)] != INT_MAX);
+}
+
+// Next cell for enemy id chasing the players. Inside the field window that is
+// the field's downhill step. Outside it, or where the window cuts off every
+// route, big maps fall back to the hierarchy. With --ai incremental it is the
+// next cell of the enemy's own repaired route instead.
+pair<int, int> chaseStep(int id, int x, int y, bool isGhost) {
+    if (incrementalAI) return incrementalStep(id, x, y, isGhost);
+
+    if (chasesOnField(x, y, isGhost)) {
+        return fieldStep(isGhost ? ghostField : chaseField, x, y, isGhost);
+    }
+    return isGhost ? greedyStep(x, y, true) : hierarchyStep(x, y);
+}
+
+// Cells that can walk to the safe point, refreshed when walls change. A
+// search towards an exit the walls cut off would scan the whole region.
+thread_local BitPlane exitReach;
+thread_local unsigned exitReachVersion = 0;
+thread_local pair<int, int> exitReachFrom = {-1, -1};
+
+bool exitReachable(pair<int, int> from) {
+    if (exitReachFrom != safePoint || exitReachVersion != wallVersion ||
+        exitReach.rows != grid.rows || exitReach.cols != grid.cols) {
+        floodFill(exitReach, safePoint, mapBits.walls);
+        exitReachFrom = safePoint;
+        exitReachVersion = wallVersion;
+    }
+    return exitReach.test(from.first, from.second);
+}
+
+// Endless mode (--endless). The map the game runs on is a window of whole
+// chunks over an unbounded world, and chunk (0, 0) is where player 1 starts.
+// A chunk's contents depend only on the seed and its coordinates, so it comes
+// out the same whenever it is first visited. Once player 1 reaches a chunk on
+// the window's edge the window moves to centre them again. Chunks that leave
+// it are parked in an LRU cache, the least recently used are spilled to disk,
+// and enemies in a parked chunk catch up coarsely when it comes back.
+const int CHUNK_SIZE = 32;
+const int CHUNK_CACHE_SIZE = 64; // Parked chunks kept in memory
+const int MIN_WINDOW_CHUNKS = 3;
+
+struct ChunkEnemy {
+    uint8_t x, y, type; // Within the chunk
+    int hp, cooldown;
+};
+
+struct Chunk {
+    vector<char> tiles;     // CHUNK_SIZE * CHUNK_SIZE, players left out
+    vector<char> terrain;
+    vector<ChunkEnemy> enemies;
+    long long parkedAt = 0; // tickCount when it left the window
+};
+
+// Directory chunks are spilled to, removed with its files when the game ends
+struct SpillDir {
+    string path;
+    set<uint64_t> chunks;
+
+    ~SpillDir() {
+        for (uint64_t key : chunks) unlink(file(key).c_str());
+        rmdir(path.c_str());
+    }
+
+    string file(uint64_t key) const {
+        return path + "/" + to_string(int32_t(key >> 32)) + "_" + to_string(int32_t(key)) + ".chunk";
+    }
+};
+
+struct ChunkStore {
+    uint32_t seed = 0;
+    int originX = 0, originY = 0; // Chunk at the window's top left
+    int rows = 0, cols = 0;       // Window size in chunks
+    list<uint64_t> lru;           // Parked chunks, most recently parked first
+    unordered_map<uint64_t, pair<Chunk, list<uint64_t>::iterator>> parked;
+    unique_ptr<SpillDir> spill;   // Made on the first spill
+};
+thread_local ChunkStore chunkStore;
+thread_local NoiseGrid chunkNoise;
+
+uint64_t chunkKey(int cx, int cy) {
+    return uint64_t(uint32_t(cx)) << 32 | uint32_t(cy);
+}
+
+// Difficulty rises every two chunks away from the start
+int chunkLevel(int cx, int cy) {
+    return 1 + max(abs(cx), abs(cy)) / 2;
+}
+
+// Same contents per chunk as setupLevel() puts on a 20x20 level, scaled to
+// the chunk's area. The start chunk keeps its centre clear for player 1.
+void generateChunk(Chunk& c, int cx, int cy) {
+    const int cells = CHUNK_SIZE * CHUNK_SIZE, scale = cells / (20 * 20);
+    uint32_t h = chunkStore.seed ^ (uint32_t)cx * 0x8da6b343u ^ (uint32_t)cy * 0xd8163841u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    mt19937 chunkRng(h);
+
+    generateNoise(chunkNoise, chunkStore.seed, cx * CHUNK_SIZE, cy * CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE);
+    c.terrain.resize(cells);
+    for (int i = 0; i < CHUNK_SIZE; ++i) {
+        const float* noise = chunkNoise.row(i);
+        for (int j = 0; j < CHUNK_SIZE; ++j) {
+            c.terrain[i * CHUNK_SIZE + j] = noise[j] < 0.2 ? '~' : noise[j] > 0.85 ? '%' : '.';
+        }
+    }
+    c.tiles.assign(cells, '.');
+    c.enemies.clear();
+    c.parkedAt = 0;
+
+    int lvl = chunkLevel(cx, cy);
+    bool start = cx == 0 && cy == 0;
+    uniform_int_distribution<int> cellDist(0, cells - 1);
+    auto place = [&](int count, int clearRadius, auto put) {
+        for (int tries = 0; count > 0 && tries < 4 * cells; ++tries) {
+            int cell = cellDist(chunkRng), x = cell / CHUNK_SIZE, y = cell % CHUNK_SIZE;
+            if (c.tiles[cell] != '.') continue;
+            if (start && !farFrom(x, y, {CHUNK_SIZE / 2, CHUNK_SIZE / 2}, clearRadius)) continue;
+            put(cell, x, y);
+            count--;
+        }
+    };
+
+    place((15 + 5 * lvl) * scale, 3, [&](int cell, int, int) { c.tiles[cell] = '#'; });
+    for (int type = 0; type < ENEMY_TYPES; ++type) {
+        place(ENEMY_ON_LEVEL[type](lvl), 7, [&](int cell, int x, int y) {
+            c.tiles[cell] = ENEMY_SYMBOLS[type];
+            c.enemies.push_back({uint8_t(x), uint8_t(y), uint8_t(type), ENEMY_HIT_POINTS[type], 0});
+        });
+    }
+    const char pickups[] = {'+', 'S', 'I', '>', 'A'};
+    place((3 + lvl / 2) * scale, 0, [&](int cell, int, int) { c.tiles[cell] = pickups[chunkRng() % 5]; });
+    place(lvl * scale, 5, [&](int cell, int, int) { c.tiles[cell] = 'T'; });
+}
+
+bool spillChunk(uint64_t key, const Chunk& c) {
+    ChunkStore& store = chunkStore;
+    if (!store.spill) {
+        const char* tmp = getenv("TMPDIR");
+        string pattern = string(tmp && *tmp ? tmp : "/tmp") + "/gridrun-chunks-XXXXXX";
+        if (!mkdtemp(&pattern[0])) return false;
+        store.spill = make_unique<SpillDir>();
+        store.spill->path = pattern;
+    }
+
+    ofstream file(store.spill->file(key), ios::binary);
+    uint32_t count = c.enemies.size();
+    file.write(c.tiles.data(), c.tiles.size());
+    file.write(c.terrain.data(), c.terrain.size());
+    file.write(reinterpret_cast<const char*>(&c.parkedAt), sizeof(c.parkedAt));
+    file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    file.write(reinterpret_cast<const char*>(c.enemies.data()), count * sizeof(ChunkEnemy));
+    if (!file) return false;
+    store.spill->chunks.insert(key);
+    return true;
+}
+
+bool readSpilledChunk(uint64_t key, Chunk& c) {
+    ChunkStore& store = chunkStore;
+    if (!store.spill || !store.spill->chunks.count(key)) return false;
+
+    string path = store.spill->file(key);
+    ifstream file(path, ios::binary);
+    uint32_t count = 0;
+    c.tiles.resize(CHUNK_SIZE * CHUNK_SIZE);
+    c.terrain.resize(CHUNK_SIZE * CHUNK_SIZE);
+    file.read(c.tiles.data(), c.tiles.size());
+    file.read(c.terrain.data(), c.terrain.size());
+    file.read(reinterpret_cast<char*>(&c.parkedAt), sizeof(c.parkedAt));
+    file.read(reinterpret_cast<char*>(&count), sizeof(count));
+    if (file && count <= (uint32_t)CHUNK_SIZE * CHUNK_SIZE) {
+        c.enemies.resize(count);
+        file.read(reinterpret_cast<char*>(c.enemies.data()), count * sizeof(ChunkEnemy));
+    }
+    file.close();
+    unlink(path.c_str());
+    store.spill->chunks.erase(key);
+    return bool(file);
+}
+
+void parkChunk(int cx, int cy, Chunk&& c) {
+    ChunkStore& store = chunkStore;
+    uint64_t key = chunkKey(cx, cy);
+    store.lru.push_front(key);
+    store.parked[key] = {move(c), store.lru.begin()};
+}
+
+// Spills parked chunks, oldest first, until CHUNK_CACHE_SIZE are left. A chunk
+// that can't be written is dropped and will be generated afresh.
+void trimChunkCache() {
+    ChunkStore& store = chunkStore;
+    while (store.parked.size() > (size_t)CHUNK_CACHE_SIZE) {
+        uint64_t key = store.lru.back();
+        store.lru.pop_back();
+        spillChunk(key, store.parked[key].first);
+        store.parked.erase(key);
+    }
+}
+
+// Plays out the enemy moves a parked chunk missed, roughly: each enemy takes
+// up to one step per missed enemy tick, chasers towards player 1 and
+// wanderers at random, staying inside the chunk and on open floor
+void catchUpChunk(Chunk& c, int cx, int cy) {
+    long long moves = min<long long>((tickCount - c.parkedAt) / max(1, enemyMoveDelay), 2 * CHUNK_SIZE);
+    if (moves <= 0) return;
+
+    ChunkStore& store = chunkStore;
+    int targetX = clamp((store.originX - cx) * CHUNK_SIZE + player1.first, 0, CHUNK_SIZE - 1);
+    int targetY = clamp((store.originY - cy) * CHUNK_SIZE + player1.second, 0, CHUNK_SIZE - 1);
+    uniform_int_distribution<int> randomDir(0, 3);
+    for (ChunkEnemy& e : c.enemies) {
+        for (long long step = 0; step < moves; ++step) {
+            int nx = e.x, ny = e.y;
+            if (ENEMY_WANDER_PERCENT[e.type] > 0) {
+                int d = randomDir(rng);
+                nx += dx[d];
+                ny += dy[d];
+            } else if (abs(targetX - e.x) >= abs(targetY - e.y)) {
+                nx += (targetX > e.x) - (targetX < e.x);
+            } else {
+                ny += (targetY > e.y) - (targetY < e.y);
+            }
+            if (nx < 0 || ny < 0 || nx >= CHUNK_SIZE || ny >= CHUNK_SIZE || c.tiles[nx * CHUNK_SIZE + ny] != '.') break;
+            c.tiles[e.x * CHUNK_SIZE + e.y] = '.';
+            c.tiles[nx * CHUNK_SIZE + ny] = ENEMY_SYMBOLS[e.type];
+            e.x = nx;
+            e.y = ny;
+        }
+    }
+}
+
+// The chunk from the cache, from disk, or freshly generated
+Chunk takeChunk(int cx, int cy) {
+    ChunkStore& store = chunkStore;
+    uint64_t key = chunkKey(cx, cy);
+    Chunk c;
+    auto it = store.parked.find(key);
+    if (it != store.parked.end()) {
+        c = move(it->second.first);
+        store.lru.erase(it->second.second);
+        store.parked.erase(it);
+    } else if (!readSpilledChunk(key, c)) {
+        generateChunk(c, cx, cy);
+        return c;
+    }
+    catchUpChunk(c, cx, cy);
+    return c;
+}
+
+// Bot target: the open cell nearest the middle of the window's east edge,
+// so a headless bot keeps heading into new chunks
+void setEndlessSafePoint() {
+    for (int y = grid.cols - 1; y >= 0; --y) {
+        for (int d = 0; d < grid.rows; ++d) {
+            for (int x : {grid.rows / 2 - d, grid.rows / 2 + d}) {
+                if (x >= 0 && x < grid.rows && isFree(x, y)) {
+                    safePoint = {x, y};
+                    return;
+                }
+            }
+        }
+    }
+    safePoint = player1;
+}
+
+// Empty floor cell closest to from, searching around walls, or from itself
+// if there is none
+pair<int, int> nearestOpenCell(pair<int, int> from) {
+    if (grid.at(from.first, from.second) == '.') return from;
+    vector<char> seen(grid.cells.size(), 0);
+    deque<pair<int, int>> queue = {from};
+    seen[grid.index(from.first, from.second)] = 1;
+    while (!queue.empty()) {
+        auto [x, y] = queue.front();
+        queue.pop_front();
+        if (grid.at(x, y) == '.') return {x, y};
+        for (int i = 0; i < 4; ++i) {
+            int nx = x + dx[i], ny = y + dy[i];
+            if (!grid.inBounds(nx, ny) || seen[grid.index(nx, ny)] || grid.at(nx, ny) == '#') continue;
+            seen[grid.index(nx, ny)] = 1;
+            queue.push_back({nx, ny});
+        }
+    }
+    return from;
+}
+
+// Parks every chunk of the current window and fills the window from the
+// chunks at the new origin. Players keep their place in the world.
+void moveWindow(int originX, int originY) {
+    PhaseTimer timer(PHASE_LEVEL);
+    ChunkStore& store = chunkStore;
+    const int cells = CHUNK_SIZE * CHUNK_SIZE;
+
+    if (!grid.cells.empty()) {
+        vector<Chunk> window(store.rows * store.cols);
+        for (int i = 0; i < store.rows * store.cols; ++i) {
+            window[i].tiles.resize(cells);
+            window[i].terrain.resize(cells);
+            window[i].parkedAt = tickCount;
+        }
+        for (int x = 0; x < grid.rows; ++x) {
+            for (int y = 0; y < grid.cols; ++y) {
+                Chunk& c = window[(x / CHUNK_SIZE) * store.cols + y / CHUNK_SIZE];
+                int local = (x % CHUNK_SIZE) * CHUNK_SIZE + y % CHUNK_SIZE;
+                char tile = grid.at(x, y);
+                c.tiles[local] = tile == '1' || tile == '2' ? '.' : tile;
+                c.terrain[local] = terrainGrid.at(x, y);
+            }
+        }
+        for (size_t i = 0; i < enemies.size(); ++i) {
+            int x = enemies.x[i], y = enemies.y[i];
+            window[(x / CHUNK_SIZE) * store.cols + y / CHUNK_SIZE].enemies.push_back(
+                {uint8_t(x % CHUNK_SIZE), uint8_t(y % CHUNK_SIZE), enemies.type[i], enemies.hp[i], enemies.cooldown[i]});
+        }
+        for (int i = 0; i < store.rows * store.cols; ++i) {
+            parkChunk(store.originX + i / store.cols, store.originY + i % store.cols, move(window[i]));
+        }
+    }
+
+    int shiftX = (originX - store.originX) * CHUNK_SIZE, shiftY = (originY - store.originY) * CHUNK_SIZE;
+    player1 = {player1.first - shiftX, player1.second - shiftY};
+    store.originX = originX;
+    store.originY = originY;
+
+    grid.resize(store.rows * CHUNK_SIZE, store.cols * CHUNK_SIZE, '.');
+    terrainGrid.resize(grid.rows, grid.cols, '.');
+    enemies.clear();
+    for (int cx = 0; cx < store.rows; ++cx) {
+        for (int cy = 0; cy < store.cols; ++cy) {
+            Chunk c = takeChunk(originX + cx, originY + cy);
+            for (int i = 0; i < CHUNK_SIZE; ++i) {
+                int x = cx * CHUNK_SIZE + i;
+                copy_n(c.tiles.begin() + i * CHUNK_SIZE, CHUNK_SIZE, &grid.at(x, cy * CHUNK_SIZE));
+                copy_n(c.terrain.begin() + i * CHUNK_SIZE, CHUNK_SIZE, &terrainGrid.at(x, cy * CHUNK_SIZE));
+            }
+            for (const ChunkEnemy& e : c.enemies) {
+                enemies.push(cx * CHUNK_SIZE + e.x, cy * CHUNK_SIZE + e.y, e.type, e.hp, e.cooldown, 0);
+            }
+        }
+    }
+    trimChunkCache();
+
+    player1 = nearestOpenCell(player1); // Only a respawn can find its cell taken
+    grid.at(player1.first, player1.second) = '1';
+    rebuildEnemyIndex();
+    rebuildMapBits();
+    enemyRoutes.clear(); // Ids were handed out afresh
+    setEndlessSafePoint();
+
+    level = chunkLevel(originX + player1.first / CHUNK_SIZE, originY + player1.second / CHUNK_SIZE);
+    enemyMoveDelay = max(50, 100 - 5 * (level - 1));
+    fullRedraw = true;
+    hierarchyStale = true;
+    ++wallVersion;
+}
+
+void startEndless(uint32_t seed) {
+    ChunkStore& store = chunkStore;
+    store = ChunkStore();
+    store.seed = seed;
+    store.rows = max(MIN_WINDOW_CHUNKS, (worldRows + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    store.cols = max(MIN_WINDOW_CHUNKS, (worldCols + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    store.originX = -(store.rows / 2);
+    store.originY = -(store.cols / 2);
+    grid.resize(0, 0, '.');
+    clearEnemies();
+
+    player1 = {(store.rows / 2) * CHUNK_SIZE + CHUNK_SIZE / 2, (store.cols / 2) * CHUNK_SIZE + CHUNK_SIZE / 2};
+    moveWindow(store.originX, store.originY);
+    player1SpeedBoost = 0;
+    player1Invincibility = 0;
+}
+
+// Recentres the window once player 1 stands in one of its edge chunks
+void followPlayerChunks() {
+    const ChunkStore& store = chunkStore;
+    int cx = player1.first / CHUNK_SIZE, cy = player1.second / CHUNK_SIZE;
+    if (cx > 0 && cy > 0 && cx < store.rows - 1 && cy < store.cols - 1) return;
+    moveWindow(store.originX + cx - store.rows / 2, store.originY + cy - store.cols / 2);
+}
+
+// Sends player 1 back to where the run began after a hit: the window moves
+// back over the start chunk and the player takes the open cell nearest its
+// centre. The caller has already cleared the player's old tile.
+void respawnAtStart() {
+    const ChunkStore& store = chunkStore;
+    int originX = -(store.rows / 2), originY = -(store.cols / 2);
+    // The start's centre in the current window's cells, moveWindow() shifts it
+    player1 = {(0 - store.originX) * CHUNK_SIZE + CHUNK_SIZE / 2, (0 - store.originY) * CHUNK_SIZE + CHUNK_SIZE / 2};
+    moveWindow(originX, originY);
+}
+
+// One game's state. The simulation works on the thread_local globals, so a
+// world is bound to a thread (its state swapped into them) while it is
+// stepped. Scratch buffers and per-tick fields stay with the thread and are
+// shared by every world it steps. The state is split into parts that are
+// swapped as units; each part lists its fields next to the swap that keeps
+// them in step with the globals, and defaults match the globals' initial
+// values.
+
+// Everything a level build produces, and all a prefetched level hands over
+struct LevelContents {
+    TileGrid grid;
+    TileGrid terrainGrid;
+    MapBits mapBits;
+    pair<int, int> player1, player2, safePoint;
+    EnemyStore enemies;
+    vector<int> enemySlot, freeEnemyIds, enemyAt;
+    vector<int> freeCounts;
+    int freeCellCount = 0;
+    ClusterHierarchy hierarchy;
+    bool hierarchyStale = true;
+    vector<char> clusterDirty;
+    vector<int> dirtyClusterList;
+
+    void swapWithThread() {
+        swap(::grid, grid);
+        swap(::terrainGrid, terrainGrid);
+        swap(::mapBits, mapBits);
+        swap(::player1, player1);
+        swap(::player2, player2);
+        swap(::safePoint, safePoint);
+        swap(::enemies, enemies);
+        swap(::enemySlot, enemySlot);
+        swap(::freeEnemyIds, freeEnemyIds);
+        swap(::enemyAt, enemyAt);
+        swap(::freeCounts, freeCounts);
+        swap(::freeCellCount, freeCellCount);
+        swap(::hierarchy, hierarchy);
+        swap(::hierarchyStale, hierarchyStale);
+        swap(::clusterDirty, clusterDirty);
+        swap(::dirtyClusterList, dirtyClusterList);
+    }
+};
+
+struct PlayerStats {
+    int health1 = 3, health2 = 3;
+    int armor1 = 0, armor2 = 0;
+    int weapons1 = 0, weapons2 = 0;
+    int player1SpeedBoost = 0, player2SpeedBoost = 0;
+    int player1Invincibility = 0, player2Invincibility = 0;
+
+    void swapWithThread() {
+        swap(::health1, health1);
+        swap(::health2, health2);
+        swap(::armor1, armor1);
+        swap(::armor2, armor2);
+        swap(::weapons1, weapons1);
+        swap(::weapons2, weapons2);
+        swap(::player1SpeedBoost, player1SpeedBoost);
+        swap(::player2SpeedBoost, player2SpeedBoost);
+        swap(::player1Invincibility, player1Invincibility);
+        swap(::player2Invincibility, player2Invincibility);
+    }
+};
+
+// Level, score, clock and randomness of the game as a whole
+struct GameProgress {
+    int level = 1;
+    int score = 0;
+    int enemyMoveDelay = 100;
+    int lastEnemyMove = 0;
+    bool paused = false;
+    int gameTime = 0;
+    char caughtPlayer = 0;
+    long long tickCount = 0;
+    GameRng rng;
+    uint32_t gameSeed = 0;
+
+    void swapWithThread() {
+        swap(::level, level);
+        swap(::score, score);
+        swap(::enemyMoveDelay, enemyMoveDelay);
+        swap(::lastEnemyMove, lastEnemyMove);
+        swap(::paused, paused);
+        swap(::gameTime, gameTime);
+        swap(::caughtPlayer, caughtPlayer);
+        swap(::tickCount, tickCount);
+        swap(::rng, rng);
+        swap(::gameSeed, gameSeed);
+    }
+};
+
+// State kept across ticks that is derived from the rest: routes, drawing and
+// reachability caches, and an endless world's chunks
+struct WorldCaches {
+    vector<EnemyRoute> enemyRoutes;
+    vector<int> dirtyCells;
+    vector<char> dirtyFlags;
+    bool fullRedraw = true;
+    uint32_t entranceTick = 0;
+    unsigned wallVersion = 0;
+    BitPlane exitReach;
+    unsigned exitReachVersion = 0;
+    pair<int, int> exitReachFrom = {-1, -1};
+    ChunkStore chunkStore;
+
+    void swapWithThread() {
+        swap(::enemyRoutes, enemyRoutes);
+        swap(::dirtyCells, dirtyCells);
+        swap(::dirtyFlags, dirtyFlags);
+        swap(::fullRedraw, fullRedraw);
+        swap(::entranceTick, entranceTick);
+        swap(::wallVersion, wallVersion);
+        swap(::exitReach, exitReach);
+        swap(::exitReachVersion, exitReachVersion);
+        swap(::exitReachFrom, exitReachFrom);
+        swap(::chunkStore, chunkStore);
+    }
+};
+
+struct World {
+    LevelContents contents;
+    PlayerStats stats;
+    GameProgress progress;
+    WorldCaches caches;
+};
+
+// Swaps w with the calling thread's state, so a second call undoes the first
+void swapWorld(World& w) {
+    w.contents.swapWithThread();
+    w.stats.swapWithThread();
+    w.progress.swapWithThread();
+    w.caches.swapWithThread();
+}
+
+// Binds a world to the calling thread for the binding's lifetime
+struct WorldBinding {
+    World& world;
+    explicit WorldBinding(World& w) : world(w) { swapWorld(world); }
+    ~WorldBinding() { swapWorld(world); }
+    WorldBinding(const WorldBinding&) = delete;
+    WorldBinding& operator=(const WorldBinding&) = delete;
+};
+
+// Levels draw from their own rng stream, seeded by the game's seed and the
+// level number, so the next level can be built ahead on another thread and
+// still come out exactly as if it were built at the transition. Replays from
+// before the streams existed turn levelStreams off and build levels from the
+// game rng, as they were recorded.
+bool levelStreams = true;
+bool prefetchLevels = false; // Build the next level on a worker while this one is played
+
+// Builds level lvl into the calling thread's state
+void buildLevel(int lvl) {
+    level = lvl;
+    if (!levelStreams) {
+        setupLevel();
+        return;
+    }
+    seed_seq stream{gameSeed, (uint32_t)lvl};
+    GameRng levelRng(stream);
+    swap(rng, levelRng);
+    setupLevel();
+    swap(rng, levelRng);
+}
+
+// The level being built ahead. The worker fills world, which only the
+// worker touches until it is joined.
+struct LevelPrefetch {
+    uint32_t seed = 0;
+    int level = 0;
+    unique_ptr<World> world;
+    thread worker;
+
+    ~LevelPrefetch() {
+        if (worker.joinable()) worker.join();
+    }
+};
+thread_local LevelPrefetch nextLevel;
+
+void startPrefetch(int lvl) {
+    if (nextLevel.worker.joinable()) nextLevel.worker.join();
+    nextLevel.seed = gameSeed;
+    nextLevel.level = lvl;
+    nextLevel.world = make_unique<World>();
+    World* world = nextLevel.world.get();
+    uint32_t seed = gameSeed;
+    nextLevel.worker = thread([world, seed, lvl] {
+        WorldBinding bound(*world);
+        gameSeed = seed;
+        buildLevel(lvl);
+        // The first enemy tick would build this on the game thread otherwise
+        if (!incrementalAI && (long long)grid.rows * grid.cols >= HIERARCHY_MIN_CELLS) buildHierarchy();
+    });
+}
+
+// Swaps the prefetched level's map, players and enemies in for the current
+// ones, if it was built for this game and level. Waits for the worker if it
+// is not done yet.
+bool takePrefetchedLevel() {
+    if (!nextLevel.world) return false;
+    nextLevel.worker.join();
+    unique_ptr<World> built = move(nextLevel.world);
+    if (nextLevel.seed != gameSeed || nextLevel.level != level || !levelStreams ||
+        built->contents.grid.rows != worldRows || built->contents.grid.cols != worldCols) {
+        return false;
+    }
+
+    built->contents.swapWithThread();
+    player1SpeedBoost = player2SpeedBoost = 0;
+    player1Invincibility = player2Invincibility = 0;
+    fullRedraw = true;
+    ++wallVersion;
+    return true;
+}
+
+// Sets up the level in level, from the prefetch if there is one, and starts
+// building the one after
+void enterLevel() {
+    PhaseTimer timer(PHASE_LEVEL);
+    if (!takePrefetchedLevel()) buildLevel(level);
+    if (prefetchLevels && levelStreams) startPrefetch(level + 1);
+}
+
+void advanceLevel() {
+    level++;
+    score += 100 * level;
+    enemyMoveDelay = max(50, enemyMoveDelay - 5);
+    enterLevel();
+}
+
+void checkTerrainEffects(pair<int, int> &player, int &health) {
+    if (mapBits.lava.test(player.first, player.second)) { // Lava damages health
+        health = max(0, health - 1);
+    }
+}
+
+bool attackEnemy(pair<int, int> player, int weaponCount) {
+    if (weaponCount <= 0) return false;
+    
+    // Check all adjacent positions for enemies
+    for (int i = 0; i < 8; ++i) { // Including diagonals
+        int nx = player.first + dx[i];
+        int ny = player.second + dy[i];
+        
+        if (!grid.inBounds(nx, ny)) continue;
+        
+        int id = enemyIdAt(nx, ny);
+        if (id < 0) continue;
+        
+        // Bosses take several hits, staggering after each one they survive
+        int slot = enemySlot[id];
+        if (--enemies.hp[slot] > 0) {
+            enemies.cooldown[slot] = HIT_STAGGER;
+        } else {
+            score += ENEMY_KILL_SCORE[enemies.type[slot]]; // Bonus for the kill
+            setTile(nx, ny, '.');
+            removeEnemy(id);
+        }
+        return true;
+    }
+    
+    return false;
+}
+
+// A player that lands on an enemy (invincible, or respawning on top of
+// one) removes it from the game
+void crushEnemyUnder(pair<int, int> player) {
+    int id = enemyIdAt(player.first, player.second);
+    if (id >= 0) removeEnemy(id);
+}
+
+void movePlayer(pair<int, int> &player, int &health, int &armor, int &weapons, 
+                int &speedBoost, int &invincibility, int input, char symbol) {
+    PhaseTimer timer(PHASE_PLAYER);
+    int nx = player.first, ny = player.second;
+    bool isMove = false;
+    
+    // Movement
+    if (input == 'w' || input == 'i' || input == KEY_UP) { nx--; isMove = true; }
+    if (input == 's' || input == 'k' || input == KEY_DOWN) { nx++; isMove = true; }
+    if (input == 'a' || input == 'j' || input == KEY_LEFT) { ny--; isMove = true; }
+    if (input == 'd' || input == 'l' || input == KEY_RIGHT) { ny++; isMove = true; }
+    
+    // Attack
+    if (input == 'f' || input == ';' || input == ' ') {
+        bool attackSuccess = attackEnemy(player, weapons);
+        if (attackSuccess) {
+            weapons = max(0, weapons - 1); // Use up weapon charge
+        }
+        return;
+    }
+    
+    if (!isMove) return;
+    
+    if (valid(nx, ny)) {
+        char target = grid.at(nx, ny);
+        
+        // Check for special spaces
+        if (target == '+') health = min(health + 1, 5);
+        else if (target == 'S') speedBoost += 10;
+        else if (target == 'I') invincibility += 10;
+        else if (target == '>') weapons = min(weapons + 3, 10);
+        else if (target == 'A') armor = min(armor + 1, 3);
+        else if (target == 'T') {
+            if (invincibility <= 0) {
+                health = max(0, health - (armor > 0 ? 1 : 2));
+                if (armor > 0) armor--;
+            }
+        }
+        else if (target == 'X') {
+            advanceLevel();
+            return;
+        }
+        else if (enemyIdAt(nx, ny) >= 0) {
+            // Hit by enemy
+            if (invincibility <= 0) {
+                if (armor > 0) {
+                    armor--;
+                } else {
+                    health--;
+                }
+                
+                if (health <= 0) {
+                    caughtPlayer = symbol;
+                    return;
+                }
+                
+                // Reset position
+                setTile(player.first, player.second, '.');
+                if (endlessWorld) {
+                    respawnAtStart();
+                    return;
+                }
+                player = (symbol == '1') ? make_pair(0, 0) : make_pair(0, grid.cols - 1);
+                setTile(player.first, player.second, symbol);
+                crushEnemyUnder(player);
+                return;
+            }
+        }
+        
+        // Make the move
+        setTile(player.first, player.second, '.');
+        player = {nx, ny};
+        setTile(nx, ny, symbol);
+        crushEnemyUnder(player); // Invincible players walk over enemies
+        
+        // Apply terrain effects
+        checkTerrainEffects(player, health);
+    }
+}
+
+// Enemies move in rounds: every enemy not staggered by a hit once, then
+// hunters that win their 50% roll again. A round first decides where each
+// acting enemy wants to go against the grid as the round found it, then
+// commits those moves one enemy at a time in slot order. Decisions never see
+// each other, so the field steps can be split across a pool of threads
+// (--ai-threads) without the outcome depending on the thread count.
+thread_local vector<int> actingEnemies;          // Slots taking a step this round
+thread_local vector<int> nextActing;
+thread_local vector<int> enemyBatches[ENEMY_TYPES]; // Acting slots of each type, in slot order
+thread_local vector<int> fieldDeciders[2];       // Acting slots stepping on a shared field, by throughWalls
+thread_local vector<char> routeDeciders;         // By slot, set when the enemy steps with chaseStep()
+thread_local vector<pair<int, int>> enemyIntents; // By slot, the cell the enemy wants
+const int PARALLEL_DECIDE_MIN = 128; // Fewer field steps than this are not worth handing out
+
+// Fixed set of threads that split a loop's index range between them. The
+// calling thread works on the first share, so a pool of n uses n threads.
+class WorkerPool {
+public:
+    explicit WorkerPool(int threads) : threadCount(max(1, threads)) {
+        for (int t = 1; t < threadCount; ++t) {
+            workers.emplace_back([this, t] { work(t); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    int size() const { return threadCount; }
+
+    // Calls fn(begin, end) on consecutive shares of [0, count) and returns
+    // once every share is done
+    void run(int count, const function<void(int, int)>& fn) {
+        {
+            lock_guard<mutex> lock(m);
+            job = &fn;
+            jobCount = count;
+            pending = threadCount - 1;
+            ++generation;
+        }
+        wake.notify_all();
+        runShare(0);
+        unique_lock<mutex> lock(m);
+        done.wait(lock, [this] { return pending == 0; });
+        job = nullptr;
+    }
+
+private:
+    void runShare(int t) {
+        int begin = (int)((long long)jobCount * t / threadCount);
+        int end = (int)((long long)jobCount * (t + 1) / threadCount);
+        if (begin < end) (*job)(begin, end);
+    }
+
+    void work(int t) {
+        unsigned seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> lock(m);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            runShare(t);
+            lock_guard<mutex> lock(m);
+            if (--pending == 0) done.notify_one();
+        }
+    }
+
+    int threadCount;
+    vector<thread> workers;
+    mutex m;
+    condition_variable wake, done;
+    const function<void(int, int)>* job = nullptr;
+    int jobCount = 0;
+    int pending = 0;
+    unsigned generation = 0;
+    bool stopping = false;
+};
+
+thread_local unique_ptr<WorkerPool> aiPool;
+
+// Sorts one type's acting enemies into random steps, taken here, shared
+// field steps and chaseStep() calls. With the policy fixed at compile time
+// the loop has no branches on the type.
+template <typename Policy>
+void classifyEnemies(const vector<int>& batch) {
+    uniform_int_distribution<int> randomDirDist(0, 3); // For random movement
+    uniform_int_distribution<int> randomMoveDist(0, 100); // For wanderer randomness
+
+    for (int i : batch) {
+        int ex = enemies.x[i], ey = enemies.y[i];
+        if (Policy::wanderPercent > 0 && randomMoveDist(rng) < Policy::wanderPercent) {
+            int direction = randomDirDist(rng);
+            enemyIntents[i] = {ex + dx[direction], ey + dy[direction]};
+        } else if (chasesOnField(ex, ey, Policy::throughWalls)) {
+            fieldDeciders[Policy::throughWalls].push_back(i);
+        } else {
+            routeDeciders[i] = 1;
+        }
+    }
+}
+
+// Decision phase. Enemies are handled a type at a time. Random draws happen
+// here on the game thread, in slot order within a type, and only types that
+// wander draw, so a seed plays the same however many threads decide. Route
+// and hierarchy steps update per-enemy caches and are taken here in slot
+// order, field steps go to the pool.
+void decideEnemyMoves() {
+    enemyIntents.resize(enemies.size());
+    routeDeciders.assign(enemies.size(), 0);
+    for (auto& batch : enemyBatches) batch.clear();
+    for (auto& deciders : fieldDeciders) deciders.clear();
+    for (int i : actingEnemies) enemyBatches[enemies.type[i]].push_back(i);
+
+    EnemyPolicies::forEach([](auto policy) {
+        using Policy = decltype(policy);
+        classifyEnemies<Policy>(enemyBatches[Policy::type]);
+    });
+    for (int i : actingEnemies) {
+        if (!routeDeciders[i]) continue;
+        enemyIntents[i] = chaseStep(enemies.id[i], enemies.x[i], enemies.y[i], ENEMY_THROUGH_WALLS[enemies.type[i]]);
+    }
+
+    // Workers have thread_local state of their own, so they get this
+    // thread's through references taken here. Walkers come first, then the
+    // enemies that follow their own field through walls.
+    const BitPlane& walls = mapBits.walls;
+    const TileGrid& terrain = terrainGrid;
+    const vector<int>& chase = chaseField;
+    const vector<int>& ghost = ghostField;
+    const EnemyStore& all = enemies;
+    const vector<int>& walkers = fieldDeciders[0];
+    const vector<int>& ghosts = fieldDeciders[1];
+    vector<pair<int, int>>& intents = enemyIntents;
+    int walkerCount = walkers.size();
+    auto decide = [&](int begin, int end) {
+        for (int k = begin; k < min(end, walkerCount); ++k) {
+            int i = walkers[k];
+            intents[i] = fieldStep(walls, terrain, chase, all.x[i], all.y[i], false);
+        }
+        for (int k = max(begin, walkerCount); k < end; ++k) {
+            int i = ghosts[k - walkerCount];
+            intents[i] = fieldStep(walls, terrain, ghost, all.x[i], all.y[i], true);
+        }
+    };
+
+    int count = walkerCount + ghosts.size();
+    if (aiThreads > 1 && count >= PARALLEL_DECIDE_MIN) {
+        if (!aiPool || aiPool->size() != aiThreads) aiPool = make_unique<WorkerPool>(aiThreads);
+        aiPool->run(count, decide);
+    } else {
+        decide(0, count);
+    }
+}
+
+// Commit phase. An enemy stepping onto a player hits them and stays put, one
+// stepping onto a wall, or a cell an earlier enemy took this round, is
+// blocked. Returns false once a player is caught.
+bool commitEnemyMoves(bool& playerRespawned) {
+    for (int i : actingEnemies) {
+        int ex = enemies.x[i], ey = enemies.y[i], type = enemies.type[i];
+        char enemySymbol = ENEMY_SYMBOLS[type];
+        bool throughWalls = ENEMY_THROUGH_WALLS[type];
+        
+        // Skip enemies a respawned player is standing on, they are
+        // removed once every enemy has moved
+        if (grid.at(ex, ey) != enemySymbol) continue;
+        
+        // Clear current position
+        setTile(ex, ey, '.');
+        
+        auto [nx, ny] = enemyIntents[i];
+        
+        // Check if valid move (ghosts can move through walls)
+        if (valid(nx, ny, throughWalls)) {
+            // Check if destination has a player
+            if ((nx == player1.first && ny == player1.second)) {
+                if (player1Invincibility <= 0) {
+                    if (armor1 > 0) {
+                        armor1--;
+                    } else {
+                        health1--;
+                    }
+                    
+                    if (health1 <= 0) {
+                        setTile(ex, ey, enemySymbol);
+                        caughtPlayer = '1';
+                        return false;
+                    }
+                    
+                    // Reset position after being hit. An endless window can't
+                    // move while enemies are being committed, so that player
+                    // is off the map until moveEnemies() calls respawnAtStart().
+                    setTile(player1.first, player1.second, '.');
+                    playerRespawned = true;
+                    if (endlessWorld) {
+                        player1 = {-1, -1};
+                    } else {
+                        player1 = {0, 0};
+                        setTile(player1.first, player1.second, '1');
+                    }
+                }
+                
+                // Enemy stays in place after hitting player
+                setTile(ex, ey, enemySymbol);
+            } else if (multiplayer && nx == player2.first && ny == player2.second) {
+                if (player2Invincibility <= 0) {
+                    if (armor2 > 0) {
+                        armor2--;
+                    } else {
+                        health2--;
+                    }
+                    
+                    if (health2 <= 0) {
+                        setTile(ex, ey, enemySymbol);
+                        caughtPlayer = '2';
+                        return false;
+                    }
+                    
+                    // Reset position after being hit
+                    setTile(player2.first, player2.second, '.');
+                    player2 = {0, grid.cols - 1};
+                    setTile(player2.first, player2.second, '2');
+                    playerRespawned = true;
+                }
+                
+                // Enemy stays in place after hitting player
+                setTile(ex, ey, enemySymbol);
+            } else if (isFree(nx, ny)) {
+                // Move enemy
+                moveEnemy(i, nx, ny);
+                setTile(nx, ny, enemySymbol);
+            } else {
+                // Blocked by another enemy or obstacle, stay in place
+                setTile(ex, ey, enemySymbol);
+            }
+        } else {
+            // Invalid move, stay in place
+            setTile(ex, ey, enemySymbol);
+        }
+    }
+    return true;
+}
+
+void moveEnemies() {
+    PhaseTimer timer(PHASE_ENEMIES);
+    uniform_int_distribution<int> randomMoveDist(0, 100);
+
+    // One search per tick, shared by every enemy
+    updateDistanceFields();
+
+    // Enemies staggered by a hit sit this tick out
+    actingEnemies.clear();
+    for (size_t i = 0; i < enemies.size(); ++i) {
+        if (enemies.cooldown[i] > 0) {
+            enemies.cooldown[i]--;
+        } else {
+            actingEnemies.push_back(i);
+        }
+    }
+    while (!actingEnemies.empty()) {
+        decideEnemyMoves();
+        bool playerRespawned = false;
+        if (!commitEnemyMoves(playerRespawned)) return;
+        
+        // Rebuilding the window renumbers the enemies, which ends the rounds
+        if (playerRespawned && endlessWorld) {
+            respawnAtStart();
+            break;
+        }
+
+        // Hunters get a 50% chance of another move
+        nextActing.clear();
+        for (int i : actingEnemies) {
+            int percent = ENEMY_EXTRA_MOVE_PERCENT[enemies.type[i]];
+            if (percent > 0 && randomMoveDist(rng) < percent) nextActing.push_back(i);
+        }
+        actingEnemies.swap(nextActing);
+        if (playerRespawned && !actingEnemies.empty()) {
+            updateDistanceFields(); // Target moved, the field is stale
+        }
+    }
+    
+    crushEnemyUnder(player1);
+    if (multiplayer) crushEnemyUnder(player2);
+}
+
+void updateStatusEffects() {
+    if (player1SpeedBoost > 0) player1SpeedBoost--;
+    if (player2SpeedBoost > 0) player2SpeedBoost--;
+    if (player1Invincibility > 0) player1Invincibility--;
+    if (player2Invincibility > 0) player2Invincibility--;
+}
+
+bool gameRunning() {
+    return caughtPlayer == 0 && health1 > 0 && (!multiplayer || health2 > 0);
+}
+
+bool isPlayer1Key(int ch) {
+    return ch == 'w' || ch == 's' || ch == 'a' || ch == 'd' || ch == 'f';
+}
+
+bool isPlayer2Key(int ch) {
+    return ch == 'i' || ch == 'k' || ch == 'j' || ch == 'l' || ch == ';';
+}
+
+// One frame of simulation. Each player gets at most one command per frame
+// (ERR when they pressed nothing).
+void updateGame(int p1Input, int p2Input) {
+    // Handle player movement
+    if ((player1SpeedBoost > 0 || lastEnemyMove % 2 == 0) && isPlayer1Key(p1Input)) {
+        movePlayer(player1, health1, armor1, weapons1, player1SpeedBoost, player1Invincibility, p1Input, '1');
+    }
+    
+    if (multiplayer && (player2SpeedBoost > 0 || lastEnemyMove % 2 == 0) && isPlayer2Key(p2Input)) {
+        movePlayer(player2, health2, armor2, weapons2, player2SpeedBoost, player2Invincibility, p2Input, '2');
+    }
+    
+    if (!gameRunning()) return;
+    
+    // Move enemies every few frames
+    if (lastEnemyMove >= enemyMoveDelay) {
+        moveEnemies();
+        updateStatusEffects();
+        lastEnemyMove = 0;
+    } else {
+        lastEnemyMove++;
+    }
+}
+
+void checkLevelCleared() {
+    // Check if all enemies are defeated. An endless world has no levels to clear.
+    if (!endlessWorld && enemies.empty()) {
+        advanceLevel();
+    }
+}
+
+// Resets every per-game variable and starts level 1 from the given seed
+void newGame(unsigned seed) {
+    rng.seed(seed);
+    gameSeed = seed;
+    level = 1;
+    score = 0;
+    health1 = health2 = 3;
+    armor1 = armor2 = 0;
+    weapons1 = weapons2 = 0;
+    enemyMoveDelay = 100;
+    lastEnemyMove = 0;
+    paused = false;
+    gameTime = 0;
+    caughtPlayer = 0;
+    tickCount = 0;
+    if (endlessWorld) {
+        startEndless(seed);
+    } else {
+        enterLevel();
+    }
+}
+
+// Inputs of a recorded game. Replaying them from the same seed and settings
+// reproduces the game exactly, since all randomness comes from rng and every
+// input is tied to the frame it was applied on. The version goes up with
+// every change to how a recorded game plays out, and versions that no longer
+// reproduce are refused. Version 1 files were written while terrain noise,
+// enemy move order, level placement and enemy hit points all changed, and
+// can't be told apart, so the oldest accepted is 2. Endless runs respawn at
+// their start from version 5 on, so older endless replays are refused too.
+const int REPLAY_VERSION = 5;
+const int MIN_REPLAY_VERSION = 2;
+const int MIN_ENDLESS_REPLAY_VERSION = 5;
+
+struct ReplayLog {
+    unsigned seed = 0;
+    int rows = 20, cols = 20;
+    bool multiplayer = false;
+    bool endless = false;
+    bool incrementalAI = false; // Version 4, older replays keep whatever --ai picked
+    int version = REPLAY_VERSION;
+    vector<tuple<long long, int, int>> inputs; // tick, player 1 key, player 2 key
+    long long endTick = 0;
+};
+
+thread_local ReplayLog* recording = nullptr; // Set by --record
+
+// Advances the game one frame, logging the inputs when recording
+void stepGame(int p1Input, int p2Input) {
+    if (recording && (p1Input != ERR || p2Input != ERR)) {
+        recording->inputs.emplace_back(tickCount, p1Input, p2Input);
+    }
+    updateGame(p1Input, p2Input);
+    if (endlessWorld && gameRunning()) followPlayerChunks();
+    checkLevelCleared();
+    endProfileTick();
+    tickCount++;
+}
+
+// Inputs a replay applies on the current frame; cursor walks log.inputs
+void replayInputs(const ReplayLog& log, size_t& cursor, int& p1Input, int& p2Input) {
+    p1Input = p2Input = ERR;
+    if (cursor < log.inputs.size() && get<0>(log.inputs[cursor]) == tickCount) {
+        p1Input = get<1>(log.inputs[cursor]);
+        p2Input = get<2>(log.inputs[cursor]);
+        cursor++;
+    }
+}
+
+// Player 1 bot for headless runs: attacks adjacent enemies while it has
+// weapon charges, otherwise heads for the safe point around enemies and traps
+int botInput() {
+    if (player1SpeedBoost <= 0 && lastEnemyMove % 2 != 0) return ERR; // Can't move this frame
+    
+    auto blocked = [](int x, int y) {
+        return mapBits.traps.test(x, y) || mapBits.enemies.test(x, y);
+    };
+    
+    if (weapons1 > 0) {
+        for (int i = 0; i < 8; ++i) {
+            int nx = player1.first + dx[i], ny = player1.second + dy[i];
+            if (grid.inBounds(nx, ny) && enemyIdAt(nx, ny) >= 0) return 'f';
+        }
+    }
+    
+    const int keys[] = {'w', 's', 'a', 'd'}; // Same order as dx/dy
+    vector<pair<int, int>> path;
+    if (exitReachable(player1)) path = dijkstraPath(player1, safePoint);
+    if (!path.empty() && !blocked(path[0].first, path[0].second)) {
+        for (int i = 0; i < 4; ++i) {
+            if (player1.first + dx[i] == path[0].first && player1.second + dy[i] == path[0].second) {
+                return keys[i];
+            }
+        }
+    }
+    
+    // Path is blocked, sidestep to the free neighbor closest to the exit
+    int bestKey = ERR, bestDist = INT_MAX;
+    for (int i = 0; i < 4; ++i) {
+        int nx = player1.first + dx[i], ny = player1.second + dy[i];
+        if (!valid(nx, ny) || blocked(nx, ny)) continue;
+        
+        int d = abs(nx - safePoint.first) + abs(ny - safePoint.second);
+        if (d < bestDist) {
+            bestDist = d;
+            bestKey = keys[i];
+        }
+    }
+    return bestKey;
+}
+
+struct GameResult {
+    int level;
+    int score;
+    long long ticks;
+};
+
+// Plays one bot-driven game without a terminal, as fast as possible
+GameResult playHeadless(unsigned seed, long long maxTicks) {
+    newGame(seed);
+    
+    while (gameRunning() && tickCount < maxTicks) {
+        stepGame(botInput(), ERR);
+        gameTime = tickCount * FRAME_MS / 1000;
+    }
+    return {level, score, tickCount};
+}
+
+// Re-runs a recorded game without a terminal, as fast as possible
+GameResult playReplayHeadless(const ReplayLog& log) {
+    incrementalAI = log.incrementalAI;
+    newGame(log.seed);
+    
+    size_t cursor = 0;
+    while (gameRunning() && tickCount < log.endTick) {
+        int p1Input, p2Input;
+        replayInputs(log, cursor, p1Input, p2Input);
+        stepGame(p1Input, p2Input);
+        gameTime = tickCount * FRAME_MS / 1000;
+    }
+    return {level, score, tickCount};
+}
+
+// Many worlds stepped on one pool of threads. Each call hands worlds out one
+// at a time, so a world that takes longer does not hold up a whole share.
+class WorldHost {
+public:
+    WorldHost(int threads, int worldCount) : worlds(worldCount), pool(threads) {}
+
+    // Calls fn(i) once for every world i, with that world bound
+    template <typename Fn>
+    void forEach(Fn fn) {
+        atomic<int> next(0);
+        int count = worlds.size();
+        pool.run(pool.size(), [&](int, int) {
+            for (int i = next++; i < count; i = next++) {
+                WorldBinding bound(worlds[i]);
+                fn(i);
+            }
+        });
+    }
+
+    vector<World> worlds;
+
+private:
+    WorkerPool pool;
+};
+
+// Plays games with seeds firstSeed.. as worlds on a WorldHost and reports
+// throughput plus the level and score distributions. Each world plays
+// SWEEP_SLICE ticks per turn and starts the next seed once its game is over.
+const int SWEEP_SLICE = 256;
+const int SWEEP_WORLDS_PER_THREAD = 16;
+
+void runSweep(int games, int threads, long long maxTicks, unsigned firstSeed) {
+    vector<GameResult> results(games);
+    atomic<int> nextGame(0);
+    atomic<int> gamesLeft(games);
+    
+    auto start = chrono::steady_clock::now();
+    WorldHost host(threads, min(games, threads * SWEEP_WORLDS_PER_THREAD));
+    vector<int> gameOf(host.worlds.size());
+    host.forEach([&](int i) {
+        gameOf[i] = nextGame++;
+        newGame(firstSeed + gameOf[i]);
+    });
+    
+    while (gamesLeft > 0) {
+        host.forEach([&](int i) {
+            if (gameOf[i] >= games) return; // Out of seeds
+            for (int t = 0; t < SWEEP_SLICE && gameRunning() && tickCount < maxTicks; ++t) {
+                stepGame(botInput(), ERR);
+            }
+            if (gameRunning() && tickCount < maxTicks) return;
+            
+            results[gameOf[i]] = {level, score, tickCount};
+            gamesLeft--;
+            gameOf[i] = nextGame++;
+            if (gameOf[i] < games) newGame(firstSeed + gameOf[i]);
+        });
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    long long totalTicks = 0;
+    map<int, int> levels;
+    vector<int> scores;
+    for (const auto& r : results) {
+        totalTicks += r.ticks;
+        levels[r.level]++;
+        scores.push_back(r.score);
+    }
+    sort(scores.begin(), scores.end());
+    
+    auto percentile = [&](double p) { return scores[(size_t)(p * (scores.size() - 1))]; };
+    double meanScore = 0;
+    for (int sc : scores) meanScore += sc;
+    meanScore /= scores.size();
+    
+    cout << "Games: " << games << "  Threads: " << threads << "  Time: " << seconds << " s\n";
+    cout << "Ticks: " << totalTicks << "  Ticks/sec: " << (long long)(totalTicks / max(seconds, 1e-9)) << "\n";
+    cout << "Level reached:\n";
+    for (const auto& [lvl, count] : levels) {
+        cout << "  " << lvl << ": " << count << "\n";
+    }
+    cout << "Score: min " << scores.front() << "  p50 " << percentile(0.5)
+         << "  p90 " << percentile(0.9) << "  max " << scores.back()
+         << "  mean " << meanScore << "\n";
+}
+
+// Plain-text save, kept for --text-save exports and older save files.
+// Version 2 starts with a "GRIDRUN-SAVE 2" line and the game seed, older
+// files start directly with the world dimensions.
+const int TEXT_SAVE_VERSION = 2;
+
+bool saveGameText(const string& filename) {
+    ofstream file(filename);
+    if (!file) {
+        return false;
+    }
+    
+    // Save the version and seed, world dimensions, then game state
+    file << "GRIDRUN-SAVE " << TEXT_SAVE_VERSION << endl;
+    file << "seed " << gameSeed << endl;
+    file << grid.rows << " " << grid.cols << endl;
+    file << level << " " << score << " " << gameTime << endl;
+    file << health1 << " " << armor1 << " " << weapons1 << " " << player1SpeedBoost << " " << player1Invincibility << endl;
+    file << health2 << " " << armor2 << " " << weapons2 << " " << player2SpeedBoost << " " << player2Invincibility << endl;
+    file << player1.first << " " << player1.second << endl;
+    file << player2.first << " " << player2.second << endl;
+    file << safePoint.first << " " << safePoint.second << endl;
+    file << multiplayer << endl;
+    
+    // Save grid
+    for (int i = 0; i < grid.rows; ++i) {
+        for (int j = 0; j < grid.cols; ++j) {
+            file << grid.at(i, j);
+        }
+        file << endl;
+    }
+    
+    // Save terrain grid
+    for (int i = 0; i < grid.rows; ++i) {
+        for (int j = 0; j < grid.cols; ++j) {
+            file << terrainGrid.at(i, j);
+        }
+        file << endl;
+    }
+    
+    // Save enemies
+    file << enemies.size() << endl;
+    for (size_t i = 0; i < enemies.size(); ++i) {
+        file << enemies.x[i] << " " << enemies.y[i] << " " << (int)enemies.type[i] << " "
+             << enemies.hp[i] << " " << enemies.cooldown[i] << endl;
+    }
+    
+    file.close();
+    return bool(file);
+}
+
+// Hit points and stagger a live enemy of this type can have
+bool validEnemyState(int type, int hp, int cooldown) {
+    return hp > 0 && hp <= ENEMY_HIT_POINTS[type] && cooldown >= 0 && cooldown <= HIT_STAGGER;
+}
+
+bool loadGameText(const string& filename) {
+    ifstream file(filename);
+    if (!file) {
+        return false;
+    }
+    
+    // Older saves have no seed line, so their later levels get a fresh seed
+    string line, key;
+    uint32_t seed = random_device{}();
+    getline(file, line);
+    if (line.rfind("GRIDRUN-SAVE", 0) == 0) {
+        int version = 0;
+        istringstream marker(line);
+        if (!(marker >> key >> version) || version != TEXT_SAVE_VERSION) return false;
+        if (!(file >> key >> seed) || key != "seed") return false;
+        getline(file, line); // Rest of the seed line
+        getline(file, line);
+    }
+    
+    // Load world dimensions. Saves from before --width/--height start
+    // directly with "level score time" and are always 20x20.
+    istringstream header(line);
+    vector<int> fields;
+    for (int v; header >> v; ) fields.push_back(v);
+
+    // Everything is parsed into locals and checked before any of it is
+    // committed, like loadGameBinary
+    int rows = 20, cols = 20;
+    int loadedLevel, loadedScore, loadedTime;
+    if (fields.size() == 2) {
+        rows = fields[0];
+        cols = fields[1];
+        file >> loadedLevel >> loadedScore >> loadedTime;
+    } else if (fields.size() == 3) {
+        loadedLevel = fields[0];
+        loadedScore = fields[1];
+        loadedTime = fields[2];
+    } else {
+        return false;
+    }
+    if (rows < MIN_WORLD_SIZE || cols < MIN_WORLD_SIZE ||
+        rows > MAX_WORLD_SIZE || cols > MAX_WORLD_SIZE) {
+        return false;
+    }
+    TileGrid tiles, terrain;
+    tiles.resize(rows, cols, '.');
+    terrain.resize(rows, cols, '.');
+
+    // Load game state
+    int stats1[5], stats2[5]; // Health, armor, weapons, speed boost, invincibility
+    pair<int, int> p1, p2, safe;
+    bool loadedMultiplayer;
+    for (int& v : stats1) file >> v;
+    for (int& v : stats2) file >> v;
+    file >> p1.first >> p1.second;
+    file >> p2.first >> p2.second;
+    file >> safe.first >> safe.second;
+    file >> loadedMultiplayer;
+    if (!file || !tiles.inBounds(p1.first, p1.second) || !tiles.inBounds(p2.first, p2.second) ||
+        !tiles.inBounds(safe.first, safe.second)) {
+        return false;
+    }
+    
+    // Consume newline
+    getline(file, line);
+    
+    // Load grid
+    for (int i = 0; i < tiles.rows; ++i) {
+        getline(file, line);
+        for (int j = 0; j < tiles.cols && j < (int)line.size(); ++j) {
+            tiles.at(i, j) = line[j];
+        }
+    }
+    
+    // Load terrain grid
+    for (int i = 0; i < terrain.rows; ++i) {
+        getline(file, line);
+        for (int j = 0; j < terrain.cols && j < (int)line.size(); ++j) {
+            terrain.at(i, j) = line[j];
+        }
+    }
+    
+    // Load enemies
+    int enemyCount;
+    if (!(file >> enemyCount) || enemyCount < 0 || (size_t)enemyCount > tiles.cells.size()) return false;
+    getline(file, line);
+    EnemyStore loadedEnemies;
+    for (int i = 0; i < enemyCount && getline(file, line); ++i) {
+        istringstream entry(line);
+        int x, y, type, hp, cooldown;
+        if (!(entry >> x >> y >> type) || !tiles.inBounds(x, y) || type < 0 || type >= ENEMY_TYPES) return false;
+        // Older saves list only position and type
+        if (!(entry >> hp >> cooldown)) {
+            hp = ENEMY_HIT_POINTS[type];
+            cooldown = 0;
+        }
+        if (!validEnemyState(type, hp, cooldown)) return false;
+        loadedEnemies.push(x, y, type, hp, cooldown, i);
+    }
+    if (!file || (int)loadedEnemies.size() != enemyCount) return false; // Truncated or malformed
+    file.close();
+    
+    // Everything checked out, commit it to the game state
+    worldRows = rows;
+    worldCols = cols;
+    grid = move(tiles);
+    terrainGrid = move(terrain);
+    level = loadedLevel;
+    score = loadedScore;
+    gameTime = loadedTime;
+    health1 = stats1[0];
+    armor1 = stats1[1];
+    weapons1 = stats1[2];
+    player1SpeedBoost = stats1[3];
+    player1Invincibility = stats1[4];
+    health2 = stats2[0];
+    armor2 = stats2[1];
+    weapons2 = stats2[2];
+    player2SpeedBoost = stats2[3];
+    player2Invincibility = stats2[4];
+    player1 = p1;
+    player2 = p2;
+    safePoint = safe;
+    multiplayer = loadedMultiplayer;
+    enemies = move(loadedEnemies);
+    rebuildEnemyIndex();
+    gameSeed = seed;
+    rebuildMapBits();
+    fullRedraw = true;
+    hierarchyStale = true;
+    ++wallVersion;
+    return true;
+}
+
+// Binary snapshot format, version 3:
+//   header   SaveHeader
+//   tiles    one byte per cell, row by row
+//   terrain  TERRAIN_CODES index, four cells per byte
+//   enemies  enemyCount SaveEnemy entries
+// Older files still load: version 1 enemy entries have no hit points or
+// cooldown, and version 1 and 2 headers end before the seed. The checksum
+// covers the header (with the checksum zeroed) and the payload, so truncated
+// or corrupted files are rejected before any game state is touched.
+const char SAVE_MAGIC[4] = {'G', 'R', 'S', 'V'};
+const uint32_t SAVE_VERSION = 3;
+
+struct SaveHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t headerSize;
+    int32_t rows, cols;
+    int32_t level, score, gameTime, enemyMoveDelay, lastEnemyMove;
+    int32_t health1, armor1, weapons1, speedBoost1, invincibility1;
+    int32_t health2, armor2, weapons2, speedBoost2, invincibility2;
+    int32_t player1X, player1Y, player2X, player2Y, safeX, safeY;
+    int32_t multiplayer;
+    uint32_t enemyCount;
+    uint64_t payloadSize;
+    uint64_t checksum;
+    uint64_t gameSeed; // Version 3, older headers end before it
+};
+const size_t SAVE_HEADER_V2_SIZE = offsetof(SaveHeader, gameSeed);
+
+struct SaveEnemy {
+    int32_t x, y, type, hp, cooldown;
+};
+const size_t SAVE_ENEMY_V1_SIZE = 3 * sizeof(int32_t); // x, y, type
+
+// Terrain symbols in the order of their 2-bit codes
+const char TERRAIN_CODES[3] = {'.', '~', '%'};
+
+uint64_t fnv1a(const unsigned char* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t saveChecksum(SaveHeader header, const unsigned char* payload) {
+    header.checksum = 0;
+    uint64_t hash = fnv1a(reinterpret_cast<const unsigned char*>(&header), header.headerSize);
+    return fnv1a(payload, header.payloadSize, hash);
+}
+
+size_t packedTerrainSize(size_t cells) {
+    return (cells + 3) / 4;
+}
+
+bool saveGameBinary(const string& filename) {
+    size_t cells = grid.cells.size();
+    size_t terrainBytes = packedTerrainSize(cells);
+    vector<unsigned char> payload(cells + terrainBytes + enemies.size() * sizeof(SaveEnemy), 0);
+    
+    memcpy(payload.data(), grid.cells.data(), cells);
+    
+    unsigned char* terrain = payload.data() + cells;
+    for (size_t i = 0; i < cells; ++i) {
+        int code = terrainGrid.cells[i] == '~' ? 1 : terrainGrid.cells[i] == '%' ? 2 : 0;
+        terrain[i / 4] |= code << ((i % 4) * 2);
+    }
+    
+    SaveEnemy* enemyTable = reinterpret_cast<SaveEnemy*>(terrain + terrainBytes);
+    for (size_t i = 0; i < enemies.size(); ++i) {
+        SaveEnemy entry = {enemies.x[i], enemies.y[i], enemies.type[i], enemies.hp[i], enemies.cooldown[i]};
+        memcpy(&enemyTable[i], &entry, sizeof(entry));
+    }
+    
+    SaveHeader header = {};
+    memcpy(header.magic, SAVE_MAGIC, sizeof(SAVE_MAGIC));
+    header.version = SAVE_VERSION;
+    header.headerSize = sizeof(SaveHeader);
+    header.rows = grid.rows;
+    header.cols = grid.cols;
+    header.level = level;
+    header.score = score;
+    header.gameTime = gameTime;
+    header.enemyMoveDelay = enemyMoveDelay;
+    header.lastEnemyMove = lastEnemyMove;
+    header.health1 = health1;
+    header.armor1 = armor1;
+    header.weapons1 = weapons1;
+    header.speedBoost1 = player1SpeedBoost;
+    header.invincibility1 = player1Invincibility;
+    header.health2 = health2;
+    header.armor2 = armor2;
+    header.weapons2 = weapons2;
+    header.speedBoost2 = player2SpeedBoost;
+    header.invincibility2 = player2Invincibility;
+    header.player1X = player1.first;
+    header.player1Y = player1.second;
+    header.player2X = player2.first;
+    header.player2Y = player2.second;
+    header.safeX = safePoint.first;
+    header.safeY = safePoint.second;
+    header.multiplayer = multiplayer;
+    header.enemyCount = enemies.size();
+    header.payloadSize = payload.size();
+    header.gameSeed = gameSeed;
+    header.checksum = saveChecksum(header, payload.data());
+    
+    // Write to a temporary file and rename it over the old save, so a crash
+    // mid-write never leaves a half-written save behind
+    string tmpName = filename + ".tmp";
+    ofstream file(tmpName, ios::binary | ios::trunc);
+    if (!file) return false;
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+    file.close();
+    if (!file || rename(tmpName.c_str(), filename.c_str()) != 0) {
+        remove(tmpName.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Maps the file read-only and validates it completely before copying
+// anything into the game state
+bool loadGameBinary(const string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < SAVE_HEADER_V2_SIZE) {
+        close(fd);
+        return false;
+    }
+    size_t fileSize = info.st_size;
+    void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+    
+    const unsigned char* data = static_cast<const unsigned char*>(mapping);
+    auto fail = [&]() {
+        munmap(mapping, fileSize);
+        return false;
+    };
+    
+    SaveHeader header = {};
+    memcpy(&header, data, SAVE_HEADER_V2_SIZE);
+    size_t headerSize = header.version < 3 ? SAVE_HEADER_V2_SIZE : sizeof(SaveHeader);
+    if (memcmp(header.magic, SAVE_MAGIC, sizeof(SAVE_MAGIC)) != 0 ||
+        header.version < 1 || header.version > SAVE_VERSION || header.headerSize != headerSize ||
+        fileSize < headerSize) {
+        return fail();
+    }
+    memcpy(&header, data, headerSize);
+    if (header.rows < MIN_WORLD_SIZE || header.cols < MIN_WORLD_SIZE ||
+        header.rows > MAX_WORLD_SIZE || header.cols > MAX_WORLD_SIZE) {
+        return fail();
+    }
+    
+    size_t cells = (size_t)header.rows * header.cols;
+    size_t terrainBytes = packedTerrainSize(cells);
+    size_t enemySize = header.version == 1 ? SAVE_ENEMY_V1_SIZE : sizeof(SaveEnemy);
+    size_t expected = cells + terrainBytes + (size_t)header.enemyCount * enemySize;
+    if (header.enemyCount > cells || header.payloadSize != expected ||
+        fileSize != headerSize + expected) {
+        return fail();
+    }
+    
+    const unsigned char* payload = data + headerSize;
+    if (saveChecksum(header, payload) != header.checksum) return fail();
+    
+    TileGrid tiles;
+    tiles.resize(header.rows, header.cols, '.');
+    if (!tiles.inBounds(header.player1X, header.player1Y) ||
+        !tiles.inBounds(header.player2X, header.player2Y) ||
+        !tiles.inBounds(header.safeX, header.safeY)) {
+        return fail();
+    }
+    
+    // Tiles are stored exactly as they are kept in memory
+    memcpy(tiles.cells.data(), payload, cells);
+    
+    TileGrid terrain;
+    terrain.resize(header.rows, header.cols, '.');
+    const unsigned char* packed = payload + cells;
+    for (size_t i = 0; i < cells; ++i) {
+        int code = (packed[i / 4] >> ((i % 4) * 2)) & 3;
+        if (code > 2) return fail();
+        terrain.cells[i] = TERRAIN_CODES[code];
+    }
+    
+    EnemyStore loadedEnemies;
+    const unsigned char* enemyTable = packed + terrainBytes;
+    for (uint32_t i = 0; i < header.enemyCount; ++i) {
+        SaveEnemy entry = {};
+        memcpy(&entry, enemyTable + i * enemySize, enemySize);
+        if (!tiles.inBounds(entry.x, entry.y) || entry.type < 0 || entry.type >= ENEMY_TYPES) return fail();
+        if (header.version == 1) entry.hp = ENEMY_HIT_POINTS[entry.type];
+        if (!validEnemyState(entry.type, entry.hp, entry.cooldown)) return fail();
+        loadedEnemies.push(entry.x, entry.y, entry.type, entry.hp, entry.cooldown, i);
+    }
+    munmap(mapping, fileSize);
+    
+    // Everything checked out, commit it to the game state
+    worldRows = header.rows;
+    worldCols = header.cols;
+    grid = move(tiles);
+    terrainGrid = move(terrain);
+    level = header.level;
+    score = header.score;
+    gameTime = header.gameTime;
+    enemyMoveDelay = header.enemyMoveDelay;
+    lastEnemyMove = header.lastEnemyMove;
+    health1 = header.health1;
+    armor1 = header.armor1;
+    weapons1 = header.weapons1;
+    player1SpeedBoost = header.speedBoost1;
+    player1Invincibility = header.invincibility1;
+    health2 = header.health2;
+    armor2 = header.armor2;
+    weapons2 = header.weapons2;
+    player2SpeedBoost = header.speedBoost2;
+    player2Invincibility = header.invincibility2;
+    player1 = {header.player1X, header.player1Y};
+    player2 = {header.player2X, header.player2Y};
+    safePoint = {header.safeX, header.safeY};
+    multiplayer = header.multiplayer != 0;
+    // Older saves have no seed, so their later levels get a fresh one
+    gameSeed = header.version >= 3 ? (uint32_t)header.gameSeed : random_device{}();
+    enemies = move(loadedEnemies);
+    rebuildEnemyIndex();
+    rebuildMapBits();
+    fullRedraw = true;
+    hierarchyStale = true;
+    ++wallVersion;
+    return true;
+}
+
+// Saves in the binary format, or as text with --text-save
+void saveGame(const string& filename) {
+    if (endlessWorld) {
+        showMessage("Endless worlds can't be saved");
+        return;
+    }
+    bool saved = textSaves ? saveGameText(filename) : saveGameBinary(filename);
+    showMessage(saved ? "Game saved successfully!" : "Failed to save game!");
+}
+
+// Loads either format, telling them apart by the binary magic
+bool loadGame(const string& filename) {
+    ifstream file(filename, ios::binary);
+    char magic[4] = {};
+    if (!file.read(magic, sizeof(magic))) return false;
+    file.close();
+    
+    if (memcmp(magic, SAVE_MAGIC, sizeof(SAVE_MAGIC)) == 0) {
+        return loadGameBinary(filename);
+    }
+    return loadGameText(filename);
+}
+
+// Replay files are text: a header with the seed and settings, one line per
+// frame that had input ("tick p1key p2key", -1 for none) and the final frame
+bool writeReplay(const string& filename, const ReplayLog& log) {
+    ofstream file(filename);
+    if (!file) return false;
+    
+    file << "GRIDRUN-REPLAY " << REPLAY_VERSION << endl;
+    file << "seed " << log.seed << endl;
+    file << "size " << log.rows << " " << log.cols << endl;
+    file << "multiplayer " << log.multiplayer << endl;
+    file << "endless " << log.endless << endl;
+    file << "ai " << (log.incrementalAI ? "incremental" : "field") << endl;
+    for (const auto& [tick, p1Input, p2Input] : log.inputs) {
+        file << tick << " " << p1Input << " " << p2Input << endl;
+    }
+    file << "end " << log.endTick << endl;
+    return bool(file);
+}
+
+bool readReplay(const string& filename, ReplayLog& log) {
+    ifstream file(filename);
+    string magic, key;
+    int version = 0;
+    if (!(file >> magic >> version) || magic != "GRIDRUN-REPLAY" ||
+        version < MIN_REPLAY_VERSION || version > REPLAY_VERSION) {
+        return false;
+    }
+    log.version = version;
+    
+    if (!(file >> key >> log.seed) || key != "seed") return false;
+    if (!(file >> key >> log.rows >> log.cols) || key != "size") return false;
+    if (!(file >> key >> log.multiplayer) || key != "multiplayer") return false;
+    if (!(file >> key >> log.endless) || key != "endless") return false;
+    if (log.endless && version < MIN_ENDLESS_REPLAY_VERSION) return false;
+    if (version >= 4) {
+        string mode;
+        if (!(file >> key >> mode) || key != "ai" || (mode != "field" && mode != "incremental")) return false;
+        log.incrementalAI = mode == "incremental";
+    }
+    if (log.rows < MIN_WORLD_SIZE || log.cols < MIN_WORLD_SIZE ||
+        log.rows > MAX_WORLD_SIZE || log.cols > MAX_WORLD_SIZE) {
+        return false;
+    }
+    
+    log.inputs.clear();
+    while (file >> key) {
+        if (key == "end") return bool(file >> log.endTick);
+        long long tick = atoll(key.c_str());
+        int p1Input, p2Input;
+        if (!(file >> p1Input >> p2Input)) return false;
+        if (!log.inputs.empty() && tick <= get<0>(log.inputs.back())) return false;
+        log.inputs.emplace_back(tick, p1Input, p2Input);
+    }
+    return false; // No end marker, the file was cut short
+}
+
+// Fingerprint of the simulation state, printed after recording and replaying
+// so runs can be compared
+uint64_t stateHash() {
+    uint64_t hash = fnv1a(reinterpret_cast<const unsigned char*>(grid.cells.data()), grid.cells.size());
+    hash = fnv1a(reinterpret_cast<const unsigned char*>(terrainGrid.cells.data()), terrainGrid.cells.size(), hash);
+    int values[] = {level, score, health1, health2, armor1, armor2, weapons1, weapons2,
+                    player1.first, player1.second, player2.first, player2.second, (int)enemies.size()};
+    hash = fnv1a(reinterpret_cast<const unsigned char*>(values), sizeof(values), hash);
+    hash = fnv1a(reinterpret_cast<const unsigned char*>(enemies.hp.data()), enemies.hp.size() * sizeof(int), hash);
+    return fnv1a(reinterpret_cast<const unsigned char*>(enemies.cooldown.data()), enemies.cooldown.size() * sizeof(int), hash);
+}
+
+// Keys read from the terminal but not yet applied by a simulation step
+struct PendingKey {
+    int ch;
+    Clock::time_point readAt;
+};
+vector<PendingKey> pendingKeys;
+
+// Queues every key that is available without waiting
+void readKeys() {
+    PhaseTimer timer(PHASE_INPUT);
+    auto now = Clock::now();
+    for (int ch = getInput(); ch != ERR; ch = getInput()) {
+        pendingKeys.push_back({ch, now});
+    }
+}
+
+// Set once stdin reaches end of file or hangs up. Polls leave it out from
+// then on, so the loops sleep until their deadlines instead of spinning.
+bool stdinClosed = false;
+
+// Queues the keys after a poll that watched stdin. Readable with nothing to
+// read means end of file.
+void readPolledKeys(short revents) {
+    size_t queued = pendingKeys.size();
+    readKeys();
+    int available = 0;
+    bool empty = pendingKeys.size() == queued &&
+                 (ioctl(STDIN_FILENO, FIONREAD, &available) != 0 || available == 0);
+    if ((revents & (POLLHUP | POLLERR | POLLNVAL)) || ((revents & POLLIN) && empty)) {
+        stdinClosed = true;
+    }
+}
+
+// Sleeps until stdin is readable or timeoutMs passes (-1 waits forever),
+// then queues every key that is available
+void waitForInput(int timeoutMs) {
+    if (stdinClosed && timeoutMs < 0) return; // Nothing will ever arrive
+    pollfd stdinPoll = {stdinClosed ? -1 : STDIN_FILENO, POLLIN, 0};
+    poll(&stdinPoll, 1, timeoutMs);
+    readPolledKeys(stdinPoll.revents);
+}
+
+// Shows the banner and blocks, without polling, until the game is unpaused
+void waitWhilePaused(bool& running) {
+    auto drawBanner = []() { renderer->drawBanner("PAUSED"); };
+    drawBanner();
+    
+    while (paused && running) {
+        waitForInput(-1);
+        if (stdinClosed) running = false; // Nobody is left to unpause
+        for (const auto& key : pendingKeys) {
+            if (key.ch == 'p' || key.ch == 'P') paused = false;
+            if (key.ch == 'q' || key.ch == 'Q') running = false;
+            if (key.ch == KEY_RESIZE) {
+                printGrid();
+                drawBanner();
+            }
+        }
+        pendingKeys.clear();
+    }
+    fullRedraw = true; // Paint over the banner
+}
+
+// Interactive game loop. The simulation advances in fixed FRAME_MS steps and
+// the screen is drawn at its own rate. In between, the loop sleeps in poll()
+// until the next deadline or a key press. Every key that arrived is applied
+// on the next step, with each player using their most recent command.
+// With a playback log the players' inputs come from the log instead and the
+// loop stops at its last frame.
+void runGameLoop(const string& saveFile, int fps, const ReplayLog* playback = nullptr) {
+    const auto frame = chrono::milliseconds(FRAME_MS);
+    const auto renderInterval = chrono::microseconds(1000000 / fps);
+    auto start = Clock::now();
+    auto nextTick = start;
+    auto nextRender = start;
+    bool running = true;
+    size_t replayCursor = 0;
+    
+    // Oldest gameplay key that has been applied but not drawn yet
+    bool inputUnshown = false;
+    Clock::time_point inputReadAt;
+    
+    while (running && gameRunning() && (!playback || tickCount < playback->endTick)) {
+        auto now = Clock::now();
+        auto deadline = min(nextTick, nextRender);
+        int timeoutMs = 0;
+        if (deadline > now) {
+            timeoutMs = chrono::duration_cast<chrono::milliseconds>(deadline - now + chrono::microseconds(999)).count();
+        }
+        waitForInput(timeoutMs);
+        now = Clock::now();
+        
+        // After a long stall (e.g. a slow level setup) skip the missed steps
+        // rather than replaying them all at once
+        if (now - nextTick > 5 * frame) nextTick = now;
+        
+        bool stepped = false;
+        while (running && !paused && gameRunning() && now >= nextTick &&
+               (!playback || tickCount < playback->endTick)) {
+            gameTime = chrono::duration_cast<chrono::seconds>(now - start).count();
+            
+            int p1Input = ERR, p2Input = ERR;
+            for (const auto& key : pendingKeys) {
+                if (key.ch == 'q' || key.ch == 'Q') {
+                    running = false;
+                } else if (key.ch == 'p' || key.ch == 'P') {
+                    paused = true;
+                } else if (key.ch == 'm' || key.ch == 'M') {
+                    saveGame(saveFile);
+                } else if (key.ch == 'o' || key.ch == 'O') {
+                    profileOverlay = !profileOverlay;
+                    profiling = profileOverlay || profileOut;
+                    profileLineTick = -1;
+                } else if (!playback && (isPlayer1Key(key.ch) || isPlayer2Key(key.ch))) {
+                    (isPlayer1Key(key.ch) ? p1Input : p2Input) = key.ch;
+                    if (!inputUnshown) {
+                        inputUnshown = true;
+                        inputReadAt = key.readAt;
+                    }
+                }
+            }
+            pendingKeys.clear();
+            if (!running || paused) break;
+            
+            if (playback) replayInputs(*playback, replayCursor, p1Input, p2Input);
+            stepGame(p1Input, p2Input);
+            nextTick += frame;
+            stepped = true;
+        }
+        
+        if (paused) {
+            waitWhilePaused(running);
+            nextTick = nextRender = Clock::now();
+            inputUnshown = false;
+            continue;
+        }
+        
+        // Draw on schedule, or right away when a step applied new input
+        if (now >= nextRender || (stepped && inputUnshown)) {
+            printGrid();
+            auto drawn = Clock::now();
+            if (inputUnshown) {
+                double sample = chrono::duration<double, milli>(drawn - inputReadAt).count();
+                inputLatencyMs = inputLatencyMs < 0 ? sample : 0.8 * inputLatencyMs + 0.2 * sample;
+                inputUnshown = false;
+            }
+            nextRender = drawn + renderInterval;
+        }
+    }
+}
+
+// Network play. A server (--serve) owns the simulation and clients
+// (--connect) send commands and draw what it sends back. The first two
+// clients control players 1 and 2 (2 only with --multiplayer), later ones
+// watch. Messages are a type byte and a little-endian 32-bit payload length.
+// After a keyframe (the whole screen) each tick sends one delta built from the
+// dirty cells and the HUD fields that changed. Each delta is encoded once and
+// the same bytes go to every client.
+enum NetMessage : uint8_t {
+    MSG_COMMAND = 1, // Client -> server: one byte, index into NET_COMMANDS
+    MSG_WELCOME,     // Slot the client plays (0 watches)
+    MSG_KEYFRAME,    // Rows, cols, tick, every HUD field, run-length coded cells
+    MSG_DELTA,       // Tick, changed HUD fields, changed cells
+    MSG_GAME_OVER,   // Who was caught, final score and level
+};
+
+const int NET_HEADER_SIZE = 5;
+const char NET_COMMANDS[2][6] = {"wsadf", "ikjl;"}; // Up, down, left, right, attack for each player
+const size_t NET_BACKLOG_LIMIT = 1 << 20; // Unsent bytes before a client is sent a keyframe instead
+const int NET_MAX_PEERS = 256;
+const uint32_t NET_MAX_CLIENT_PAYLOAD = 1; // Clients only send commands, longer messages drop them
+const size_t NET_CLIENT_READ_LIMIT = 4096; // Bytes taken from one client per pass
+
+// Everything the status lines and the view need besides the cells
+const int HUD_FIELDS = 18;
+using HudState = array<int, HUD_FIELDS>;
+
+HudState hudState() {
+    return {level, score, gameTime, multiplayer, player1.first, player1.second, player2.first, player2.second,
+            health1, armor1, weapons1, player1SpeedBoost, player1Invincibility,
+            health2, armor2, weapons2, player2SpeedBoost, player2Invincibility};
+}
+
+void applyHudState(const HudState& hud) {
+    level = hud[0];
+    score = hud[1];
+    gameTime = hud[2];
+    multiplayer = hud[3];
+    player1 = {hud[4], hud[5]};
+    player2 = {hud[6], hud[7]};
+    health1 = hud[8];
+    armor1 = hud[9];
+    weapons1 = hud[10];
+    player1SpeedBoost = hud[11];
+    player1Invincibility = hud[12];
+    health2 = hud[13];
+    armor2 = hud[14];
+    weapons2 = hud[15];
+    player2SpeedBoost = hud[16];
+    player2Invincibility = hud[17];
+}
+
+// What a client draws for a cell: the tile, or the terrain under a floor tile
+char displaySymbol(int idx) {
+    char symbol = grid.cells[idx];
+    return symbol == '.' ? terrainGrid.cells[idx] : symbol;
+}
+
+void putVarint(vector<uint8_t>& buf, uint64_t value) {
+    while (value >= 0x80) {
+        buf.push_back(uint8_t(value) | 0x80);
+        value >>= 7;
+    }
+    buf.push_back(uint8_t(value));
+}
+
+bool getVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// HUD values can in principle be negative, so they are zigzag coded
+void putHudValue(vector<uint8_t>& buf, int value) {
+    putVarint(buf, (uint32_t(value) << 1) ^ uint32_t(value >> 31));
+}
+
+bool getHudValue(const uint8_t*& p, const uint8_t* end, int& value) {
+    uint64_t raw;
+    if (!getVarint(p, end, raw)) return false;
+    value = int(uint32_t(raw >> 1) ^ -uint32_t(raw & 1));
+    return true;
+}
+
+// Starts a message in buf; endMessage() fills in its length
+size_t beginMessage(vector<uint8_t>& buf, NetMessage type) {
+    size_t start = buf.size();
+    buf.push_back(type);
+    buf.resize(start + NET_HEADER_SIZE);
+    return start;
+}
+
+void endMessage(vector<uint8_t>& buf, size_t start) {
+    uint32_t length = buf.size() - start - NET_HEADER_SIZE;
+    for (int i = 0; i < 4; ++i) buf[start + 1 + i] = uint8_t(length >> (8 * i));
+}
+
+void encodeKeyframe(vector<uint8_t>& buf) {
+    size_t start = beginMessage(buf, MSG_KEYFRAME);
+    putVarint(buf, grid.rows);
+    putVarint(buf, grid.cols);
+    putVarint(buf, tickCount);
+    for (int value : hudState()) putHudValue(buf, value);
+
+    // Runs of one symbol, so open floor and wall blocks cost a few bytes
+    int cells = grid.cells.size();
+    for (int i = 0; i < cells;) {
+        char symbol = displaySymbol(i);
+        int run = 1;
+        while (i + run < cells && displaySymbol(i + run) == symbol) run++;
+        putVarint(buf, run);
+        buf.push_back(symbol);
+        i += run;
+    }
+    endMessage(buf, start);
+}
+
+// Appends the changes since lastHud and the last clearDirtyCells(), or
+// nothing when there are none
+void encodeDelta(vector<uint8_t>& buf, HudState& lastHud) {
+    HudState hud = hudState();
+    uint32_t changed = 0;
+    for (int i = 0; i < HUD_FIELDS; ++i) {
+        if (hud[i] != lastHud[i]) changed |= 1u << i;
+    }
+    if (!changed && dirtyCells.empty()) return;
+
+    size_t start = beginMessage(buf, MSG_DELTA);
+    putVarint(buf, tickCount);
+    putVarint(buf, changed);
+    for (int i = 0; i < HUD_FIELDS; ++i) {
+        if (changed >> i & 1) putHudValue(buf, hud[i]);
+    }
+    lastHud = hud;
+
+    // Sorted, so each cell is a short gap from the one before
+    sort(dirtyCells.begin(), dirtyCells.end());
+    putVarint(buf, dirtyCells.size());
+    int prev = 0;
+    for (int idx : dirtyCells) {
+        putVarint(buf, idx - prev);
+        buf.push_back(displaySymbol(idx));
+        prev = idx;
+    }
+    endMessage(buf, start);
+}
+
+// "PORT" is loopback TCP, anything else the path of a UNIX socket.
+// Returns a non-blocking socket, or -1.
+int openSocket(const string& address, bool listening) {
+    bool tcp = !address.empty() && all_of(address.begin(), address.end(), ::isdigit);
+    sockaddr_storage addr = {};
+    socklen_t addrLength;
+    if (tcp) {
+        sockaddr_in* in = reinterpret_cast<sockaddr_in*>(&addr);
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(address.c_str()));
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addrLength = sizeof(sockaddr_in);
+    } else {
+        sockaddr_un* un = reinterpret_cast<sockaddr_un*>(&addr);
+        if (address.size() >= sizeof(un->sun_path)) return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address.c_str());
+        addrLength = sizeof(sockaddr_un);
+    }
+
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    bool ok;
+    if (listening) {
+        if (tcp) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        else unlink(address.c_str());
+        ok = bind(fd, reinterpret_cast<sockaddr*>(&addr), addrLength) == 0 && listen(fd, 16) == 0;
+    } else {
+        ok = connect(fd, reinterpret_cast<sockaddr*>(&addr), addrLength) == 0;
+    }
+    if (!ok) {
+        close(fd);
+        return -1;
+    }
+    if (tcp) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+struct NetPeer {
+    int fd = -1;
+    int slot = 0;              // Player 1 or 2, 0 watches
+    vector<uint8_t> in;        // Received, not yet parsed
+    vector<uint8_t> out;       // Queued, sent up to outSent
+    size_t outSent = 0;
+    bool needsKeyframe = true; // Joined, or fell too far behind to catch up with deltas
+    int command = ERR;         // Latest key for the next tick
+};
+
+// Reads whatever has arrived, or stops once in holds limit bytes and leaves
+// the rest for the next pass. False once the other end is gone.
+bool receive(int fd, vector<uint8_t>& in, size_t limit = SIZE_MAX) {
+    uint8_t chunk[4096];
+    while (in.size() < limit) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n > 0) {
+            in.insert(in.end(), chunk, chunk + n);
+        } else if (n == 0) {
+            return false;
+        } else {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+    }
+    return true;
+}
+
+// Sends as much of the queue as the socket takes. False on error.
+bool flushPeer(NetPeer& peer) {
+    while (peer.outSent < peer.out.size()) {
+        ssize_t n = send(peer.fd, peer.out.data() + peer.outSent, peer.out.size() - peer.outSent, MSG_NOSIGNAL);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        peer.outSent += n;
+    }
+    peer.out.clear();
+    peer.outSent = 0;
+    return true;
+}
+
+// Payload length in the header at offset, which must have arrived
+uint32_t messageLength(const vector<uint8_t>& in, size_t offset) {
+    uint32_t length = 0;
+    for (int i = 0; i < 4; ++i) length |= uint32_t(in[offset + 1 + i]) << (8 * i);
+    return length;
+}
+
+// Takes the next complete message off the front of in, if there is one
+bool nextMessage(vector<uint8_t>& in, size_t& offset, uint8_t& type, vector<uint8_t>& payload) {
+    if (in.size() - offset < (size_t)NET_HEADER_SIZE) return false;
+    uint32_t length = messageLength(in, offset);
+    if (in.size() - offset - NET_HEADER_SIZE < length) return false;
+
+    type = in[offset];
+    payload.assign(in.begin() + offset + NET_HEADER_SIZE, in.begin() + offset + NET_HEADER_SIZE + length);
+    offset += NET_HEADER_SIZE + length;
+    return true;
+}
+
+void sendWelcome(NetPeer& peer) {
+    size_t start = beginMessage(peer.out, MSG_WELCOME);
+    peer.out.push_back(peer.slot);
+    endMessage(peer.out, start);
+}
+
+// Runs the game for connected clients until it ends. The clock starts when
+// the first player joins; a player who leaves hands their slot to the
+// longest-waiting watcher.
+void runServer(const string& address) {
+    int listenFd = openSocket(address, true);
+    if (listenFd < 0) {
+        cout << "Failed to listen on " << address << endl;
+        return;
+    }
+    cout << "Serving on " << address << endl;
+
+    const auto frame = chrono::milliseconds(FRAME_MS);
+    vector<NetPeer> peers;
+    vector<uint8_t> broadcast, keyframe;
+    vector<uint8_t> payload;
+    HudState lastHud = hudState();
+    clearDirtyCells();
+    bool started = false;
+    auto nextTick = Clock::now();
+
+    auto assignSlot = [&](NetPeer& peer) {
+        for (int slot = 1; slot <= (multiplayer ? 2 : 1); ++slot) {
+            bool taken = any_of(peers.begin(), peers.end(), [&](const NetPeer& p) { return p.slot == slot; });
+            if (!taken) {
+                peer.slot = slot;
+                return;
             }
         }
-        else if (target == 'X') {
-            level++;
-            score += 100 * level;
-            enemyMoveDelay = max(50, enemyMoveDelay - 5);
-            setupLevel();
-            return;
+    };
+
+    while (gameRunning()) {
+        vector<pollfd> fds = {{listenFd, POLLIN, 0}};
+        for (const NetPeer& peer : peers) {
+            fds.push_back({peer.fd, short(POLLIN | (peer.out.empty() ? 0 : POLLOUT)), 0});
         }
-        else if (target == 'E' || target == 'W' || target == 'H' || target == 'G' || target == 'B') {
-            // Hit by enemy
-            if (invincibility <= 0) {
-                if (armor > 0) {
-                    armor--;
-                } else {
-                    health--;
+        int timeoutMs = -1;
+        if (started) {
+            timeoutMs = max(0L, (long)chrono::duration_cast<chrono::milliseconds>(nextTick - Clock::now()).count());
+        }
+        poll(fds.data(), fds.size(), timeoutMs);
+
+        // Commands and hang-ups
+        for (size_t i = 0; i < peers.size(); ++i) {
+            NetPeer& peer = peers[i];
+            bool alive = !(fds[i + 1].revents & (POLLERR | POLLNVAL)) && receive(peer.fd, peer.in, NET_CLIENT_READ_LIMIT);
+            size_t offset = 0;
+            uint8_t type;
+            // A length no client message has is dropped at the header, before
+            // its payload is buffered
+            auto oversized = [&]() {
+                return peer.in.size() - offset >= (size_t)NET_HEADER_SIZE &&
+                       messageLength(peer.in, offset) > NET_MAX_CLIENT_PAYLOAD;
+            };
+            while (alive && !oversized() && nextMessage(peer.in, offset, type, payload)) {
+                if (type == MSG_COMMAND && payload.size() == 1 && payload[0] < 5 && peer.slot) {
+                    peer.command = NET_COMMANDS[peer.slot - 1][payload[0]];
                 }
-                
-                if (health <= 0) {
-                    endNCurses();
-                    cout << "\nGame Over: Player " << symbol << " was caught!\n";
-                    cout << "Final Score: " << score << "\n";
-                    cout << "Level Reached: " << level << "\n";
-                    cout << "Time Survived: " << gameTime << " seconds\n";
-                    exit(0);
+            }
+            if (oversized()) alive = false;
+            peer.in.erase(peer.in.begin(), peer.in.begin() + offset);
+            if (alive) alive = flushPeer(peer);
+            if (!alive) {
+                close(peer.fd);
+                peer.fd = -1;
+            }
+        }
+        for (NetPeer& peer : peers) {
+            if (peer.fd >= 0) continue;
+            int slot = peer.slot;
+            peer.slot = 0;
+            if (!slot) continue;
+            cout << "Player " << slot << " left" << endl;
+            for (NetPeer& other : peers) {
+                if (other.fd >= 0 && other.slot == 0) {
+                    other.slot = slot;
+                    sendWelcome(other);
+                    cout << "A watcher took over player " << slot << endl;
+                    break;
                 }
-                
-                // Reset position
-                grid[player.first][player.second] = '.';
-                player = (symbol == '1') ? make_pair(0, 0) : make_pair(0, N-1);
-                grid[player.first][player.second] = symbol;
-                return;
             }
         }
-        
-        // Make the move
-        grid[player.first][player.second] = '.';
-        player = {nx, ny};
-        grid[nx][ny] = symbol;
-        
-        // Apply terrain effects
-        checkTerrainEffects(player, health);
-    }
-}
+        peers.erase(remove_if(peers.begin(), peers.end(), [](const NetPeer& p) { return p.fd < 0; }), peers.end());
 
-void moveEnemies() {
-    uniform_int_distribution<int> randomDirDist(0, 3); // For random movement
-    uniform_int_distribution<int> randomMoveDist(0, 100); // For wanderer randomness
-    
-    for (size_t i = 0; i < enemies.size(); ++i) {
-        auto& [ex, ey, type] = enemies[i];
-        char enemySymbol;
-        
-        // Get the correct symbol for this enemy type
-        switch (type) {
-            case NORMAL: enemySymbol = 'E'; break;
-            case WANDERER: enemySymbol = 'W'; break;
-            case HUNTER: enemySymbol = 'H'; break;
-            case GHOST: enemySymbol = 'G'; break;
-            case BOSS: enemySymbol = 'B'; break;
-            default: enemySymbol = 'E';
+        // New clients
+        if (fds[0].revents & POLLIN) {
+            for (int fd = accept(listenFd, nullptr, nullptr); fd >= 0; fd = accept(listenFd, nullptr, nullptr)) {
+                if ((int)peers.size() >= NET_MAX_PEERS) {
+                    close(fd);
+                    continue;
+                }
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Fails harmlessly on UNIX sockets
+                NetPeer peer;
+                peer.fd = fd;
+                assignSlot(peer);
+                sendWelcome(peer);
+                cout << (peer.slot ? "Player " + to_string(peer.slot) + " joined" : string("A watcher joined")) << endl;
+                peers.push_back(move(peer));
+            }
         }
-        
-        // Skip if it's dead
-        if (grid[ex][ey] != enemySymbol) continue;
-        
-        // Clear current position
-        grid[ex][ey] = '.';
-        
-        int nx = ex, ny = ey;
-        
-        // Different movement patterns based on enemy type
-        if (type == WANDERER && randomMoveDist(rng) < 30) {
-            // 30% chance to move randomly
-            int direction = randomDirDist(rng);
-            nx = ex + dx[direction];
-            ny = ey + dy[direction];
-        } else if (type == GHOST) {
-            // Ghost follows shortest path, ignoring walls
-            auto path = dijkstraPath({ex, ey}, multiplayer ? 
-                (health1 <= health2 ? player1 : player2) : player1, true);
-            
-            if (!path.empty()) {
-                nx = path[0].first;
-                ny = path[0].second;
+
+        if (!started && any_of(peers.begin(), peers.end(), [](const NetPeer& p) { return p.slot > 0; })) {
+            started = true;
+            nextTick = Clock::now();
+        }
+
+        // Simulation, skipping missed steps after a long stall like the local loop
+        auto now = Clock::now();
+        if (now - nextTick > 5 * frame) nextTick = now;
+        while (started && gameRunning() && now >= nextTick) {
+            int p1Input = ERR, p2Input = ERR;
+            for (NetPeer& peer : peers) {
+                if (peer.slot) (peer.slot == 1 ? p1Input : p2Input) = peer.command;
+                peer.command = ERR;
             }
-        } else if (type == HUNTER) {
-            // Hunter moves twice as fast (50% chance for another move)
-            auto path = dijkstraPath({ex, ey}, multiplayer ? 
-                (health1 <= health2 ? player1 : player2) : player1);
-            
-            if (!path.empty()) {
-                nx = path[0].first;
-                ny = path[0].second;
+            stepGame(p1Input, p2Input);
+            gameTime = tickCount * FRAME_MS / 1000;
+            nextTick += frame;
+
+            // A new level resets dirty tracking, so everyone gets a keyframe
+            broadcast.clear();
+            if (fullRedraw) {
+                encodeKeyframe(broadcast);
+                lastHud = hudState();
+            } else {
+                encodeDelta(broadcast, lastHud);
             }
-        } else {
-            // Normal enemy pathfinding
-            auto path = dijkstraPath({ex, ey}, multiplayer ? 
-                (health1 <= health2 ? player1 : player2) : player1);
-            
-            if (!path.empty()) {
-                nx = path[0].first;
-                ny = path[0].second;
+            clearDirtyCells();
+            for (NetPeer& peer : peers) {
+                if (peer.needsKeyframe) continue;
+                peer.out.insert(peer.out.end(), broadcast.begin(), broadcast.end());
+                if (peer.out.size() - peer.outSent > NET_BACKLOG_LIMIT) peer.needsKeyframe = true;
             }
         }
-        
-        // Check if valid move (Ghost can move through walls)
-        if (valid(nx, ny, type == GHOST)) {
-            // Check if destination has a player
-            if ((nx == player1.first && ny == player1.second)) {
-                if (player1Invincibility <= 0) {
-                    if (armor1 > 0) {
-                        armor1--;
-                    } else {
-                        health1--;
-                    }
-                    
-                    if (health1 <= 0) {
-                        endNCurses();
-                        cout << "\nGame Over: Player 1 was caught!\n";
-                        cout << "Final Score: " << score << "\n";
-                        cout << "Level Reached: " << level << "\n";
-                        cout << "Time Survived: " << gameTime << " seconds\n";
-                        exit(0);
-                    }
-                    
-                    // Reset position after being hit
-                    grid[player1.first][player1.second] = '.';
-                    player1 = {0, 0};
-                    grid[player1.first][player1.second] = '1';
-                }
-                
-                // Enemy stays in place after hitting player
-                enemies[i] = {ex, ey, type};
-                grid[ex][ey] = enemySymbol;
-            } else if (multiplayer && nx == player2.first && ny == player2.second) {
-                if (player2Invincibility <= 0) {
-                    if (armor2 > 0) {
-                        armor2--;
-                    } else {
-                        health2--;
-                    }
-                    
-                    if (health2 <= 0) {
-                        endNCurses();
-                        cout << "\nGame Over: Player 2 was caught!\n";
-                        cout << "Final Score: " << score << "\n";
-                        cout << "Level Reached: " << level << "\n";
-                        cout << "Time Survived: " << gameTime << " seconds\n";
-                        exit(0);
-                    }
-                    
-                    // Reset position after being hit
-                    grid[player2.first][player2.second] = '.';
-                    player2 = {0, N-1};
-                    grid[player2.first][player2.second] = '2';
-                }
-                
-                // Enemy stays in place after hitting player
-                enemies[i] = {ex, ey, type};
-                grid[ex][ey] = enemySymbol;
-            } else if (grid[nx][ny] == '.') {
-                // Move enemy
-                enemies[i] = {nx, ny, type};
-                grid[nx][ny] = enemySymbol;
-            } else {
-                // Blocked by another enemy or obstacle, stay in place
-                enemies[i] = {ex, ey, type};
-                grid[ex][ey] = enemySymbol;
-            }
-        } else {
-            // Invalid move, stay in place
-            enemies[i] = {ex, ey, type};
-            grid[ex][ey] = enemySymbol;
+
+        // Keyframes for new clients, and for slow ones once their backlog is
+        // back under the limit. Stale deltas still queued ahead of it are harmless.
+        keyframe.clear();
+        for (NetPeer& peer : peers) {
+            if (!peer.needsKeyframe || peer.out.size() - peer.outSent > NET_BACKLOG_LIMIT) continue;
+            if (keyframe.empty()) encodeKeyframe(keyframe);
+            peer.out.insert(peer.out.end(), keyframe.begin(), keyframe.end());
+            peer.needsKeyframe = false;
         }
-        
-        // Hunter gets a second move
-        if (type == HUNTER && randomMoveDist(rng) < 50) {
-            // Recursively give this hunter another move
-            i--; // Process this enemy again
+        for (NetPeer& peer : peers) {
+            if (!flushPeer(peer)) peer.out.clear();
         }
     }
-}
 
-void updateStatusEffects() {
-    if (player1SpeedBoost > 0) player1SpeedBoost--;
-    if (player2SpeedBoost > 0) player2SpeedBoost--;
-    if (player1Invincibility > 0) player1Invincibility--;
-    if (player2Invincibility > 0) player2Invincibility--;
+    // Tell everyone how it ended and give slow clients a moment to read it
+    for (NetPeer& peer : peers) {
+        size_t start = beginMessage(peer.out, MSG_GAME_OVER);
+        peer.out.push_back(caughtPlayer);
+        putVarint(peer.out, score);
+        putVarint(peer.out, level);
+        endMessage(peer.out, start);
+        for (int tries = 0; tries < 20 && flushPeer(peer) && !peer.out.empty(); ++tries) {
+            pollfd outPoll = {peer.fd, POLLOUT, 0};
+            poll(&outPoll, 1, 50);
+        }
+        close(peer.fd);
+    }
+    close(listenFd);
+    if (!address.empty() && !all_of(address.begin(), address.end(), ::isdigit)) unlink(address.c_str());
 }
 
-void saveGame(const string& filename) {
-    ofstream file(filename);
-    if (!file) {
-        mvprintw(N+10, 1, "Failed to save game!");
-        refresh();
-        return;
+// Applies one server message to the local copy of the game. False if it
+// does not make sense, which ends the session.
+bool applyServerMessage(uint8_t type, const vector<uint8_t>& payload, int& slot, bool& over) {
+    const uint8_t* p = payload.data();
+    const uint8_t* end = p + payload.size();
+    uint64_t value;
+
+    if (type == MSG_WELCOME) {
+        if (payload.size() != 1 || payload[0] > 2) return false;
+        slot = payload[0];
+        followPlayer = max(slot, 1);
+        fullRedraw = true;
+        showMessage(slot ? "Playing as P" + to_string(slot) : string("Watching"));
+        return true;
     }
-    
-    // Save game state
-    file << level << " " << score << " " << gameTime << endl;
-    file << health1 << " " << armor1 << " " << weapons1 << " " << player1SpeedBoost << " " << player1Invincibility << endl;
-    file << health2 << " " << armor2 << " " << weapons2 << " " << player2SpeedBoost << " " << player2Invincibility << endl;
-    file << player1.first << " " << player1.second << endl;
-    file << player2.first << " " << player2.second << endl;
-    file << safePoint.first << " " << safePoint.second << endl;
-    file << multiplayer << endl;
-    
-    // Save grid
-    for (int i = 0; i < N; ++i) {
-        for (int j = 0; j < N; ++j) {
-            file << grid[i][j];
-        }
-        file << endl;
+    if (type == MSG_GAME_OVER) {
+        if (payload.empty()) return false;
+        caughtPlayer = payload[0];
+        p++;
+        if (!getVarint(p, end, value)) return false;
+        score = value;
+        if (!getVarint(p, end, value)) return false;
+        level = value;
+        over = true;
+        return true;
     }
-    
-    // Save terrain grid
-    for (int i = 0; i < N; ++i) {
-        for (int j = 0; j < N; ++j) {
-            file << terrainGrid[i][j];
-        }
-        file << endl;
+    if (type != MSG_KEYFRAME && type != MSG_DELTA) return true; // Newer servers may send more
+
+    uint64_t rows = grid.rows, cols = grid.cols;
+    if (type == MSG_KEYFRAME) {
+        if (!getVarint(p, end, rows) || !getVarint(p, end, cols)) return false;
+        if (rows < 1 || cols < 1 || rows > MAX_WORLD_SIZE || cols > MAX_WORLD_SIZE) return false;
     }
-    
-    // Save enemies
-    file << enemies.size() << endl;
-    for (const auto& enemy : enemies) {
-        file << get<0>(enemy) << " " << get<1>(enemy) << " " << get<2>(enemy) << endl;
+    if (!getVarint(p, end, value)) return false;
+    tickCount = value;
+
+    HudState hud = hudState();
+    uint64_t changed = (1u << HUD_FIELDS) - 1;
+    if (type == MSG_DELTA && !getVarint(p, end, changed)) return false;
+    for (int i = 0; i < HUD_FIELDS; ++i) {
+        if ((changed >> i & 1) && !getHudValue(p, end, hud[i])) return false;
     }
-    
-    file.close();
-    mvprintw(N+10, 1, "Game saved successfully!");
-    refresh();
+    applyHudState(hud);
+
+    // Terrain is already folded into the symbols the server sends
+    if (type == MSG_KEYFRAME) {
+        grid.resize(rows, cols, '.');
+        terrainGrid.resize(rows, cols, '.');
+        size_t cell = 0;
+        while (p < end) {
+            if (!getVarint(p, end, value) || p == end || value > grid.cells.size() - cell) return false;
+            fill_n(grid.cells.begin() + cell, value, char(*p++));
+            cell += value;
+        }
+        fullRedraw = true;
+    } else {
+        uint64_t count, idx = 0;
+        if (!getVarint(p, end, count)) return false;
+        for (uint64_t i = 0; i < count; ++i) {
+            if (!getVarint(p, end, value) || p == end) return false;
+            idx += value;
+            if (idx >= grid.cells.size()) return false;
+            grid.cells[idx] = *p++;
+            markDirty(idx / grid.cols, idx % grid.cols);
+        }
+    }
+    endProfileTick();
+    return true;
 }
 
-bool loadGame(const string& filename) {
-    ifstream file(filename);
-    if (!file) {
-        return false;
+// Command index for a key, or -1. Either player's keys work for whichever
+// player this client controls.
+int commandForKey(int ch) {
+    switch (ch) {
+        case 'w': case 'i': case KEY_UP: return 0;
+        case 's': case 'k': case KEY_DOWN: return 1;
+        case 'a': case 'j': case KEY_LEFT: return 2;
+        case 'd': case 'l': case KEY_RIGHT: return 3;
+        case 'f': case ';': case ' ': return 4;
     }
-    
-    // Load game state
-    file >> level >> score >> gameTime;
-    file >> health1 >> armor1 >> weapons1 >> player1SpeedBoost >> player1Invincibility;
-    file >> health2 >> armor2 >> weapons2 >> player2SpeedBoost >> player2Invincibility;
-    file >> player1.first >> player1.second;
-    file >> player2.first >> player2.second;
-    file >> safePoint.first >> safePoint.second;
-    file >> multiplayer;
-    
-    // Consume newline
-    string line;
-    getline(file, line);
-    
-    // Load grid
-    for (int i = 0; i < N; ++i) {
-        getline(file, line);
-        for (int j = 0; j < N && j < line.size(); ++j) {
-            grid[i][j] = line[j];
+    return -1;
+}
+
+// Draws the server's game and forwards keys until the game ends, the
+// connection drops or the player quits. Returns a message for the console.
+string runClient(int fd, int fps) {
+    const auto renderInterval = chrono::microseconds(1000000 / fps);
+    vector<uint8_t> payload;
+    NetPeer server; // Buffers both directions like the server does for its clients
+    server.fd = fd;
+    int slot = 0;
+    bool over = false;
+    bool haveFrame = false, changed = false;
+    auto nextRender = Clock::now();
+
+    while (!over) {
+        pollfd fds[2] = {{stdinClosed ? -1 : STDIN_FILENO, POLLIN, 0},
+                         {fd, short(POLLIN | (server.out.empty() ? 0 : POLLOUT)), 0}};
+        int timeoutMs = -1;
+        if (changed) {
+            timeoutMs = max(0L, (long)chrono::duration_cast<chrono::milliseconds>(nextRender - Clock::now()).count());
+        }
+        poll(fds, 2, timeoutMs);
+
+        readPolledKeys(fds[0].revents);
+        for (const auto& key : pendingKeys) {
+            if (key.ch == 'q' || key.ch == 'Q') return "Left the game";
+            if (key.ch == 'o' || key.ch == 'O') {
+                profileOverlay = !profileOverlay;
+                profiling = profileOverlay || profileOut;
+                profileLineTick = -1;
+                changed = true;
+            } else if (key.ch == KEY_RESIZE) {
+                changed = true;
+            }
+            int command = commandForKey(key.ch);
+            if (command >= 0 && slot) {
+                size_t start = beginMessage(server.out, MSG_COMMAND);
+                server.out.push_back(command);
+                endMessage(server.out, start);
+            }
+        }
+        pendingKeys.clear();
+
+        // Whatever the socket doesn't take now goes out on a later pass
+        bool alive = flushPeer(server) && receive(fd, server.in);
+        size_t offset = 0;
+        uint8_t type;
+        while (nextMessage(server.in, offset, type, payload)) {
+            if (!applyServerMessage(type, payload, slot, over)) return "Bad message from the server";
+            haveFrame |= type == MSG_KEYFRAME;
+            changed = true;
+        }
+        server.in.erase(server.in.begin(), server.in.begin() + offset);
+        if (over) break;
+        if (!alive) return "Lost connection to the server";
+
+        if (haveFrame && changed && Clock::now() >= nextRender) {
+            printGrid();
+            changed = false;
+            nextRender = Clock::now() + renderInterval;
         }
     }
-    
-    // Load terrain grid
-    for (int i = 0; i < N; ++i) {
-        getline(file, line);
-        for (int j = 0; j < N && j < line.size(); ++j) {
-            terrainGrid[i][j] = line[j];
+
+    if (caughtPlayer) return string("Game Over: Player ") + caughtPlayer + " was caught!";
+    return "Game Over!";
+}
+
+// Batched single-player environments for training bots, stepped as worlds on
+// a WorldHost. Observations are what a client would draw, as one tile id
+// (index into OBS_TILES) per cell in row-major order, written straight into
+// buffers the caller owns: env i uses obs[i * obsSize()...]. After the first
+// write only cells that changed are rewritten, as long as the caller keeps
+// passing the same buffer. The reward is the score gained, so it follows the
+// scoring in movePlayer() and attackEnemy(). An env whose game ends reports
+// done and starts its next game in the same call; its observation is then
+// the new game's first frame.
+const char OBS_TILES[] = ".#12EWHGB+SI>ATX~%";
+const int VEC_ACTIONS = 6; // 0 waits, 1-5 are NET_COMMANDS for player 1
+
+class VecEnv {
+public:
+    VecEnv(int count, int threads, unsigned seed)
+        : host(threads, count), firstSeed(seed), episodes(count), obsSeen(count, nullptr),
+          obsCells((size_t)worldRows * worldCols) {
+        memset(tileIds, 0, sizeof(tileIds));
+        for (int i = 0; OBS_TILES[i]; ++i) tileIds[(uint8_t)OBS_TILES[i]] = i;
+        host.forEach([&](int i) { newGame(seedFor(i)); });
+    }
+
+    int size() const { return host.worlds.size(); }
+    size_t obsSize() const { return obsCells; } // Fixed, worlds may be bound on other threads
+
+    // Starts the next game in every env that has played a frame, and
+    // writes every env's observation
+    void reset(uint8_t* obs) {
+        host.forEach([&](int i) {
+            if (tickCount > 0) {
+                episodes[i]++;
+                newGame(seedFor(i));
+            }
+            observe(i, obs);
+        });
+    }
+
+    void step(const int32_t* actions, uint8_t* obs, float* rewards, uint8_t* dones) {
+        host.forEach([&](int i) {
+            int action = actions[i];
+            int key = action > 0 && action < VEC_ACTIONS ? NET_COMMANDS[0][action - 1] : ERR;
+            int before = score;
+            // Frames the player can't move on pass by themselves, so every action counts
+            while (gameRunning() && player1SpeedBoost <= 0 && lastEnemyMove % 2 != 0) advance(ERR);
+            if (gameRunning()) advance(key);
+            rewards[i] = score - before;
+            dones[i] = !gameRunning();
+            if (dones[i]) {
+                episodes[i]++;
+                newGame(seedFor(i));
+            }
+            observe(i, obs);
+        });
+    }
+
+private:
+    unsigned seedFor(int i) const { return firstSeed + i + (unsigned)size() * episodes[i]; }
+
+    void advance(int key) {
+        stepGame(key, ERR);
+        gameTime = tickCount * FRAME_MS / 1000;
+    }
+
+    // Writes world i's view into its slice of obs, then starts tracking
+    // changes from here
+    void observe(int i, uint8_t* obs) {
+        uint8_t* out = obs + i * obsSize();
+        if (fullRedraw || obsSeen[i] != out) {
+            for (size_t idx = 0; idx < grid.cells.size(); ++idx) out[idx] = tileIds[(uint8_t)displaySymbol(idx)];
+        } else {
+            for (int idx : dirtyCells) out[idx] = tileIds[(uint8_t)displaySymbol(idx)];
         }
+        obsSeen[i] = out;
+        clearDirtyCells();
     }
-    
-    // Load enemies
-    int enemyCount;
-    file >> enemyCount;
-    enemies.clear();
-    for (int i = 0; i < enemyCount; ++i) {
-        int x, y, type;
-        file >> x >> y >> type;
-        enemies.emplace_back(x, y, static_cast<EnemyType>(type));
+
+    WorldHost host;
+    unsigned firstSeed;
+    vector<unsigned> episodes;
+    vector<const uint8_t*> obsSeen; // Buffer each env last wrote, so a new one gets a full write
+    size_t obsCells;
+    uint8_t tileIds[256];
+};
+
+// C interface for loading the game as a shared library (see ReadMe.md). Every
+// env in a process uses the same world size, since new games read worldRows
+// and worldCols; creating one of another size while others are alive fails.
+// rows and cols are clamped like --height and --width.
+mutex vecEnvLock;
+int liveVecEnvs = 0;
+
+extern "C" {
+
+VecEnv* gridrun_vec_create(int count, int threads, int rows, int cols, unsigned seed) {
+    if (count < 1) return nullptr;
+    rows = clamp(rows, MIN_WORLD_SIZE, MAX_WORLD_SIZE);
+    cols = clamp(cols, MIN_WORLD_SIZE, MAX_WORLD_SIZE);
+    lock_guard<mutex> lock(vecEnvLock);
+    if (liveVecEnvs > 0) {
+        if (rows != worldRows || cols != worldCols) return nullptr;
+    } else {
+        worldRows = rows;
+        worldCols = cols;
+        multiplayer = false;
+        endlessWorld = false;
+        prefetchLevels = false;
     }
-    
-    file.close();
-    return true;
+    liveVecEnvs++;
+    return new VecEnv(count, threads, seed);
+}
+
+void gridrun_vec_destroy(VecEnv* env) {
+    if (!env) return;
+    delete env;
+    lock_guard<mutex> lock(vecEnvLock);
+    liveVecEnvs--;
+}
+
+size_t gridrun_vec_obs_size(const VecEnv* env) {
+    return env->obsSize();
+}
+
+void gridrun_vec_reset(VecEnv* env, uint8_t* obs) {
+    env->reset(obs);
+}
+
+void gridrun_vec_step(VecEnv* env, const int32_t* actions, uint8_t* obs, float* rewards, uint8_t* dones) {
+    env->step(actions, obs, rewards, dones);
+}
+
 }
 
+#ifndef GRIDRUN_NO_MAIN // bench.cpp includes this file and brings its own main
 int main(int argc, char* argv[]) {
     bool loadFromSave = false;
-    string saveFile = "game_save.txt";
+    string saveFile = "game_save.dat";
+    bool headless = false;
+    int sweepGames = 0;
+    int sweepThreads = 1;
+    long long maxTicks = 50000;
+    int fps = 30;
+    unsigned seed = time(nullptr);
+    bool seedGiven = false;
+    string recordFile, replayFile, profileFile;
+    string serveAddress, connectAddress;
+    string renderName = "ncurses";
+    string aiName = "field";
     
     // Parse command line arguments
     for (int i = 1; i < argc; ++i) {
@@ -974,89 +5276,203 @@ int main(int argc, char* argv[]) {
             loadFromSave = true;
         } else if (arg == "--save" && i + 1 < argc) {
             saveFile = argv[++i];
+        } else if (arg == "--text-save") {
+            textSaves = true;
         } else if (arg == "--multiplayer") {
             multiplayer = true;
+        } else if (arg == "--endless") {
+            endlessWorld = true;
+        } else if (arg == "--width" && i + 1 < argc) {
+            worldCols = clamp(atoi(argv[++i]), MIN_WORLD_SIZE, MAX_WORLD_SIZE);
+        } else if (arg == "--height" && i + 1 < argc) {
+            worldRows = clamp(atoi(argv[++i]), MIN_WORLD_SIZE, MAX_WORLD_SIZE);
+        } else if (arg == "--fps" && i + 1 < argc) {
+            fps = clamp(atoi(argv[++i]), 1, 240);
+        } else if (arg == "--headless") {
+            headless = true;
+        } else if (arg == "--sweep" && i + 1 < argc) {
+            sweepGames = max(1, atoi(argv[++i]));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            sweepThreads = max(1, atoi(argv[++i]));
+        } else if (arg == "--max-ticks" && i + 1 < argc) {
+            maxTicks = max(1LL, atoll(argv[++i]));
+        } else if (arg == "--ai" && i + 1 < argc) {
+            aiName = argv[++i];
+        } else if (arg == "--ai-threads" && i + 1 < argc) {
+            aiThreads = clamp(atoi(argv[++i]), 1, 64);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = strtoul(argv[++i], nullptr, 10);
+            seedGiven = true;
+        } else if (arg == "--record" && i + 1 < argc) {
+            recordFile = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayFile = argv[++i];
+        } else if (arg == "--profile-out" && i + 1 < argc) {
+            profileFile = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serveAddress = argv[++i];
+        } else if (arg == "--connect" && i + 1 < argc) {
+            connectAddress = argv[++i];
+        } else if (arg == "--render" && i + 1 < argc) {
+            renderName = argv[++i];
         }
     }
     
-    initNCurses();
+    if (renderName != "ncurses" && renderName != "ansi" && renderName != "null") {
+        cout << "--render takes ncurses, ansi or null" << endl;
+        return 1;
+    }
+    if (aiName != "field" && aiName != "incremental") {
+        cout << "--ai takes field or incremental" << endl;
+        return 1;
+    }
+    incrementalAI = aiName == "incremental";
     
-    if (loadFromSave) {
-        if (!loadGame(saveFile)) {
-            endNCurses();
-            cout << "Failed to load game from " << saveFile << endl;
+    // The window follows player 1 alone and has no save format
+    if (endlessWorld && (multiplayer || loadFromSave)) {
+        cout << "--endless can't be combined with --multiplayer or --load" << endl;
+        return 1;
+    }
+    
+    // Sweep games run on their own threads and are not profiled
+    if (!profileFile.empty() && sweepGames == 0) {
+        profileOut = fopen(profileFile.c_str(), "w");
+        if (!profileOut) {
+            cout << "Failed to open " << profileFile << endl;
             return 1;
         }
-    } else {
-        setupLevel();
+        fprintf(profileOut, "tick");
+        for (const char* name : PHASE_NAMES) fprintf(profileOut, ",%s_us", name);
+        fputc('\n', profileOut);
+        profiling = true;
     }
     
-    bool running = true;
-    int lastEnemyMove = 0;
-    int gameStartTime = time(nullptr);
+    if (sweepGames > 0) {
+        runSweep(sweepGames, sweepThreads, maxTicks, seedGiven ? seed : 1);
+        return 0;
+    }
+    prefetchLevels = true; // A single game has cores to spare, a sweep keeps them busy
     
-    while (running && health1 > 0 && (!multiplayer || health2 > 0)) {
-        printGrid();
-        
-        // Update game time
-        gameTime = time(nullptr) - gameStartTime;
-        
-        // Process input
-        int ch = getInput();
-        if (ch == 'q' || ch == 'Q') {
-            running = false;
-        } else if (ch == 'p' || ch == 'P') {
-            paused = !paused;
-            if (paused) {
-                mvprintw(N/2, N/2-4, "PAUSED");
-                refresh();
-                while (getInput() != 'p' && getInput() != 'P') {
-                    this_thread::sleep_for(chrono::milliseconds(100));
-                }
-                paused = false;
-            }
-        } else if (ch == 'm' || ch == 'M') {
-            saveGame(saveFile);
+    // The server sends everything a client draws, so world options are the server's
+    if (!connectAddress.empty()) {
+        int fd = openSocket(connectAddress, false);
+        if (fd < 0) {
+            cout << "Failed to connect to " << connectAddress << endl;
+            return 1;
+        }
+        openRenderer(renderName);
+        string result = runClient(fd, fps);
+        closeRenderer();
+        close(fd);
+        cout << "\n" << result << "\n";
+        cout << "Final Score: " << score << "\n";
+        cout << "Level Reached: " << level << "\n";
+        if (profileOut) fclose(profileOut);
+        return 0;
+    }
+    
+    // A replay brings its own seed and world settings
+    ReplayLog replay;
+    replay.incrementalAI = incrementalAI; // Replays from before version 4 don't record it
+    bool replaying = !replayFile.empty();
+    if (replaying) {
+        if (!readReplay(replayFile, replay)) {
+            cout << "Failed to load replay from " << replayFile << endl;
+            return 1;
+        }
+        seed = replay.seed;
+        worldRows = replay.rows;
+        worldCols = replay.cols;
+        multiplayer = replay.multiplayer;
+        endlessWorld = replay.endless;
+        incrementalAI = replay.incrementalAI;
+        levelStreams = replay.version >= 3; // Older replays built levels from the game rng
+        loadFromSave = false;
+    }
+    
+    ReplayLog record;
+    if (!recordFile.empty()) {
+        if (loadFromSave) {
+            cout << "--record starts a new game and can't be combined with --load" << endl;
+            return 1;
+        }
+        record.seed = seed;
+        record.rows = worldRows;
+        record.cols = worldCols;
+        record.multiplayer = multiplayer;
+        record.endless = endlessWorld;
+        record.incrementalAI = incrementalAI;
+        recording = &record;
+    }
+    
+    auto finishRun = [&]() {
+        if (profileOut) {
+            fclose(profileOut);
+            profileOut = nullptr;
+            cout << "Profile written to " << profileFile << "\n";
+        }
+        if (replaying || recording) {
+            printf("State hash: %016llx\n", (unsigned long long)stateHash());
+        }
+        if (!recording) return;
+        record.endTick = tickCount;
+        if (writeReplay(recordFile, record)) {
+            cout << "Replay saved to " << recordFile << "\n";
         } else {
-            // Handle player movement
-            if ((player1SpeedBoost > 0 || lastEnemyMove % 2 == 0) && 
-                (ch == 'w' || ch == 's' || ch == 'a' || ch == 'd' || ch == 'f')) {
-                movePlayer(player1, health1, armor1, weapons1, player1SpeedBoost, player1Invincibility, ch, '1');
-            }
-            
-            if (multiplayer && (player2SpeedBoost > 0 || lastEnemyMove % 2 == 0) && 
-                (ch == 'i' || ch == 'k' || ch == 'j' || ch == 'l' || ch == ';')) {
-                movePlayer(player2, health2, armor2, weapons2, player2SpeedBoost, player2Invincibility, ch, '2');
-            }
-            
-            // Move enemies every few frames
-            if (lastEnemyMove >= enemyMoveDelay) {
-                moveEnemies();
-                updateStatusEffects();
-                lastEnemyMove = 0;
-            } else {
-                lastEnemyMove++;
-            }
+            cout << "Failed to save replay to " << recordFile << "\n";
         }
+    };
+    
+    if (!serveAddress.empty()) {
+        newGame(seed);
+        runServer(serveAddress);
+        if (caughtPlayer) cout << "Game Over: Player " << caughtPlayer << " was caught!\n";
+        cout << "Final Score: " << score << "\n";
+        cout << "Level Reached: " << level << "\n";
+        finishRun();
+        return 0;
+    }
+    
+    if (headless) {
+        auto start = chrono::steady_clock::now();
+        GameResult result = replaying ? playReplayHeadless(replay) : playHeadless(seed, maxTicks);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
         
-        // Check if all enemies are defeated
-        if (enemies.empty()) {
-            level++;
-            score += 100 * level;
-            enemyMoveDelay = max(50, enemyMoveDelay - 5);
-            setupLevel();
+        if (caughtPlayer) cout << "Game Over: Player " << caughtPlayer << " was caught!\n";
+        cout << "Final Score: " << result.score << "\n";
+        cout << "Level Reached: " << result.level << "\n";
+        cout << "Ticks: " << result.ticks << "  Ticks/sec: " << (long long)(result.ticks / max(seconds, 1e-9)) << "\n";
+        finishRun();
+        return 0;
+    }
+    
+    openRenderer(renderName);
+    
+    if (loadFromSave) {
+        if (!loadGame(saveFile)) {
+            closeRenderer();
+            cout << "Failed to load game from " << saveFile << endl;
+            return 1;
         }
-        
-        // Slow down the game loop
-        this_thread::sleep_for(chrono::milliseconds(50));
+        if (!endlessWorld) startPrefetch(level + 1);
+    } else {
+        newGame(seed);
     }
     
-    endNCurses();
+    runGameLoop(saveFile, fps, replaying ? &replay : nullptr);
+    
+    closeRenderer();
     
-    cout << "\nGame Over!\n";
+    if (caughtPlayer) {
+        cout << "\nGame Over: Player " << caughtPlayer << " was caught!\n";
+    } else {
+        cout << "\nGame Over!\n";
+    }
     cout << "Final Score: " << score << "\n";
     cout << "Level Reached: " << level << "\n";
     cout << "Time Survived: " << gameTime << " seconds\n";
+    finishRun();
     
     return 0;
 }
+#endif